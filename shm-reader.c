@@ -0,0 +1,49 @@
+// See LICENSE for license
+
+// Prints the controller state published by wii-u-gc-adapter --shm NAME.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "wii-u-gc-shm.h"
+
+int main(int argc, char *argv[])
+{
+   const char *name = argc > 1 ? argv[1] : "/wii-u-gc-adapter";
+   const struct gc_shm *shm = gc_shm_open(name);
+   if (shm == NULL)
+   {
+      fprintf(stderr, "cannot map %s, is the daemon running with --shm?\n", name);
+      return 1;
+   }
+
+   while (1)
+   {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      int64_t now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+      for (int i = 0; i < GC_SHM_PORTS; i++)
+      {
+         struct gc_shm_port port;
+         gc_shm_read_port(shm, i, &port);
+         if (!port.connected)
+            continue;
+         printf("port %d: buttons=%04x x=%3u y=%3u cx=%3u cy=%3u l=%3u r=%3u report=%llu age=%.1fus\n",
+               i + 1, port.buttons, port.axis[0], port.axis[1], port.axis[2],
+               port.axis[3], port.axis[4], port.axis[5], (unsigned long long)port.report,
+               (now - port.time) / 1000.0);
+      }
+      printf("\n");
+      fflush(stdout);
+
+      struct timespec frame = { 0, 16666667 };
+      nanosleep(&frame, NULL);
+   }
+
+   gc_shm_close(shm);
+   return 0;
+}
@@ -1,27 +1,48 @@
 // See LICENSE for license
 
-#define _XOPEN_SOURCE 600
+#define _GNU_SOURCE
 
 #include <time.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <getopt.h>
 
 #include <linux/input.h>
 #include <linux/uinput.h>
+#include <linux/uhid.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sched.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include <libudev.h>
 #include <libusb.h>
 #include <pthread.h>
 
+#include "wii-u-gc-shm.h"
+
 #if (!defined(LIBUSBX_API_VERSION) || LIBUSBX_API_VERSION < 0x01000102) && (!defined(LIBUSB_API_VERSION) || LIBUSB_API_VERSION < 0x01000102)
 #error libusb(x) 1.0.16 or higher is required
 #endif
@@ -35,8 +56,131 @@
 #define STATE_NORMAL   0x10
 #define STATE_WAVEBIRD 0x20
 
-#define MAX_FF_EVENTS 4
+#define DEFAULT_FF_EFFECTS 4
+#define MAX_FF_EFFECTS 64
+
+#define MAX_RUMBLE_PWM_HZ 1000
+
+// full drive level of the rumble synthesis
+#define FF_LEVEL_MAX 0xffff
+
+// latency samples buffered between stats drains, must be a power of two
+#define SAMPLE_RING_SIZE 4096
+
+// log-linear histogram, 2^(HIST_SUB_BITS-1) buckets per power of two
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT (HIST_SUB_COUNT / 2)
+#define HIST_BUCKETS ((32 - HIST_SUB_BITS + 2) * HIST_HALF_COUNT)
+
+#define STATS_DRAIN_MSEC 100
+
+// how long a replaced profile is kept at least
+#define PORT_MAP_GRACE_MSEC 1000
+
+#define NSEC_PER_USEC 1000LL
+#define NSEC_PER_MSEC 1000000LL
+#define NSEC_PER_SEC  1000000000LL
+
+// force feedback requests read from uinput in one go
+#define FF_READ_BATCH 16
+
+// profile limits per port
+#define MAX_COMBOS 8
+#define MAX_BUTTON_AXES 4
+#define MAX_AXIS_TERMS 16
+
+// bits of a port's button state: the report's 16 buttons, then the axes
+// past their profile threshold, then the combos
+#define BIT_AXIS_BUTTON 16
+#define BIT_COMBO 22
+
+// events one port's part of a report can turn into: every button bit,
+// every axis, the axes driven by buttons and the SYN_REPORT
+#define MAX_PAYLOAD_EVENTS (32 + 6 + MAX_BUTTON_AXES + 1)
+
+// decoded events buffered per port until the next flush, room for several
+// reports' worth of MAX_PAYLOAD_EVENTS
+#define PORT_EVENT_BUFFER 128
+
+// longest a full uinput queue may hold up the emission path
+#define UINPUT_WRITE_TIMEOUT_MSEC 2
+
+// older kernel headers only have the struct timeval member
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
+#define REPORT_SIZE 37
+
+// must be a power of two
+#define REPORT_QUEUE_SIZE 64
+
+#define DEFAULT_IN_TRANSFERS 4
+#define MAX_IN_TRANSFERS 32
+
+// records buffered per adapter and kind between the hot path and the
+// capture writer thread, must be a power of two
+#define CAPTURE_RING_SIZE 2048
+// adapter ids a capture record can hold, freed ids are handed out again
+#define CAPTURE_IDS 256
+#define CAPTURE_MAGIC "WUGCCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_RECORD_SIZE 64
+
+// reports fed in one go when replaying as fast as possible
+#define REPLAY_BATCH 4096
+
+// how long each benchmark runs
+#define BENCH_MSEC 500
+// reports cycled through by the benchmarks, must be a power of two
+#define BENCH_REPORTS 256
+
+#define DEFAULT_SYNTHETIC_RATE 1000
+#define MAX_SYNTHETIC_RATE 1000000
+
+// axis-only frames per second and port with --emit rate
+#define DEFAULT_EMIT_RATE 250
+#define MAX_EMIT_RATE 1000
+
+// how long the virtual devices of an unplugged adapter wait for it
+#define DEFAULT_REPLUG_GRACE_MSEC 2000
+
+// threads opening and closing adapters, so a roomful of them comes up at once
+#define HOTPLUG_WORKERS 4
+
+// adapters serviced at once; each gets a slot that numbers its ports
+#define MAX_ADAPTERS 64
+#define MAX_PORTS (MAX_ADAPTERS * 4)
+#if MAX_ADAPTERS > GC_SHM_ADAPTERS
+#error "the shared memory segment needs a slot group for every adapter slot"
+#endif
+
+// after a transfer error the adapter is restarted in place, waiting twice
+// as long before each attempt, and given up after MAX_RECOVERY_ATTEMPTS
+#define RECOVERY_BACKOFF_MIN_MSEC 10
+#define RECOVERY_BACKOFF_MAX_MSEC 1000
+#define MAX_RECOVERY_ATTEMPTS 8
+
+// synthetic reports that fail with --synthetic-faults, per 1000
+#define MAX_SYNTHETIC_FAULTS 1000
 
+// a --output uhid port's HID reports: the input report is its id, 12
+// buttons, the d-pad as a hat switch and the 6 axes; the output report is
+// its id and a rumble level
+#define HID_INPUT_REPORT 1
+#define HID_INPUT_SIZE 9
+#define HID_OUTPUT_REPORT 2
+#define UHID_INPUT2_HEADER offsetof(struct uhid_event, u.input2.data)
+
+// connections to the control socket, the longest command line and how much
+// unread output a client may pile up before it's dropped
+#define MAX_CONTROL_CLIENTS 8
+#define CONTROL_LINE_SIZE 256
+#define CONTROL_OUTPUT_MAX (1 << 20)
+
+// the default layout, a --profile starts from it
 const int BUTTON_OFFSET_VALUES[16] = {
    BTN_START,
    BTN_TR2,
@@ -65,51 +209,837 @@ const int AXIS_OFFSET_VALUES[6] = {
    ABS_RZ
 };
 
+const char *AXIS_NAMES[6] = { "x", "y", "cx", "cy", "l", "r" };
+
+// profile names of the report's button bits
+const char *BUTTON_NAMES[16] = {
+   "start", "z", "r", "l", NULL, NULL, NULL, NULL,
+   "a", "b", "x", "y", "left", "right", "down", "up",
+};
+
+struct code_name
+{
+   const char *name;
+   int type;
+   int code;
+};
+
+#define CODE_NAME(type, code) { #code, type, code }
+
+// event codes a profile can send
+const struct code_name CODE_NAMES[] = {
+   CODE_NAME(EV_KEY, BTN_SOUTH),
+   CODE_NAME(EV_KEY, BTN_EAST),
+   CODE_NAME(EV_KEY, BTN_NORTH),
+   CODE_NAME(EV_KEY, BTN_WEST),
+   CODE_NAME(EV_KEY, BTN_A),
+   CODE_NAME(EV_KEY, BTN_B),
+   CODE_NAME(EV_KEY, BTN_C),
+   CODE_NAME(EV_KEY, BTN_X),
+   CODE_NAME(EV_KEY, BTN_Y),
+   CODE_NAME(EV_KEY, BTN_Z),
+   CODE_NAME(EV_KEY, BTN_TL),
+   CODE_NAME(EV_KEY, BTN_TR),
+   CODE_NAME(EV_KEY, BTN_TL2),
+   CODE_NAME(EV_KEY, BTN_TR2),
+   CODE_NAME(EV_KEY, BTN_SELECT),
+   CODE_NAME(EV_KEY, BTN_START),
+   CODE_NAME(EV_KEY, BTN_MODE),
+   CODE_NAME(EV_KEY, BTN_THUMBL),
+   CODE_NAME(EV_KEY, BTN_THUMBR),
+   CODE_NAME(EV_KEY, BTN_DPAD_UP),
+   CODE_NAME(EV_KEY, BTN_DPAD_DOWN),
+   CODE_NAME(EV_KEY, BTN_DPAD_LEFT),
+   CODE_NAME(EV_KEY, BTN_DPAD_RIGHT),
+   CODE_NAME(EV_KEY, BTN_TRIGGER_HAPPY1),
+   CODE_NAME(EV_KEY, BTN_TRIGGER_HAPPY2),
+   CODE_NAME(EV_KEY, BTN_TRIGGER_HAPPY3),
+   CODE_NAME(EV_KEY, BTN_TRIGGER_HAPPY4),
+   CODE_NAME(EV_ABS, ABS_X),
+   CODE_NAME(EV_ABS, ABS_Y),
+   CODE_NAME(EV_ABS, ABS_Z),
+   CODE_NAME(EV_ABS, ABS_RX),
+   CODE_NAME(EV_ABS, ABS_RY),
+   CODE_NAME(EV_ABS, ABS_RZ),
+   CODE_NAME(EV_ABS, ABS_THROTTLE),
+   CODE_NAME(EV_ABS, ABS_RUDDER),
+   CODE_NAME(EV_ABS, ABS_GAS),
+   CODE_NAME(EV_ABS, ABS_BRAKE),
+   CODE_NAME(EV_ABS, ABS_HAT0X),
+   CODE_NAME(EV_ABS, ABS_HAT0Y),
+};
+
+// HID button of each report button bit, 0 for none. hid-input turns gamepad
+// buttons 1-12 into BTN_SOUTH ... BTN_START, so this gives the default
+// uinput layout; the d-pad bits go into the hat switch instead
+const uint8_t HID_BUTTON_USAGES[16] = { 12, 10, 8, 7, 0, 0, 0, 0, 1, 5, 2, 4, 0, 0, 0, 0 };
+
+// hat switch position indexed by the d-pad bits (left, right, down, up),
+// 8 is centered
+const uint8_t HID_HAT_VALUES[16] = { 8, 6, 2, 8, 4, 5, 3, 4, 0, 7, 1, 0, 8, 6, 2, 8 };
+
+// generic desktop usage of each report axis, matching AXIS_OFFSET_VALUES
+const uint8_t HID_AXIS_USAGES[6] = { 0x30, 0x31, 0x33, 0x34, 0x32, 0x35 };
+
+// scaled ranges used when an axis isn't calibrated and raw mode is off
+const int DEFAULT_AXIS_RANGES[6][2] = {
+   { 20, 235 },
+   { 20, 235 },
+   { 30, 225 },
+   { 30, 225 },
+   { 25, 225 },
+   { 25, 225 },
+};
+
+// derived from BUTTON_OFFSET_VALUES by init_decoder()
+static uint16_t button_mask;
+
+struct axis_calibration
+{
+   bool set;
+   int center;
+   int min;
+   int max;
+   int deadzone;
+   int fuzz;
+   double curve;
+};
+
+struct port_calibration
+{
+   struct axis_calibration axes[6];
+   // radial deadzone of the main and C sticks, in output units
+   int radial[2];
+   // analog trigger level that also presses the digital L/R button
+   int threshold[2];
+};
+
+// a port_calibration compiled for the decoder, every axis is one table load
+struct port_luts
+{
+   unsigned char lut[6][256];
+   int radial_sq[2];
+   // 256 never triggers
+   int threshold[2];
+   int absmin[6];
+   int absmax[6];
+   int absfuzz[6];
+   int absflat[6];
+   // where the axis is with the stick centered or the trigger let go
+   unsigned char rest[6];
+};
+
+// everything about a virtual device that's fixed once it's created
+struct device_caps
+{
+   // empty for the default name; a "%d" is replaced by the port number
+   char name[UINPUT_MAX_NAME_SIZE];
+   uint16_t vendor;
+   uint16_t product;
+   // uncalibrated axes advertise the full 0-255 range
+   bool raw;
+   uint8_t keybits[KEY_CNT / 8];
+   uint64_t absbits;
+   // ranges of the axes driven by buttons, indexed like button_axes
+   int32_t absrange[MAX_BUTTON_AXES][2];
+};
+
+// an axis whose value is the sum of the values of its pressed buttons
+struct button_axis
+{
+   int code;
+   uint32_t mask;
+   int term_count;
+   uint8_t bit[MAX_AXIS_TERMS];
+   int16_t value[MAX_AXIS_TERMS];
+};
+
+// a profile compiled for one port, the decoder only indexes into it
+struct port_map
+{
+   struct device_caps caps;
+   // EV_KEY code per button state bit, -1 sends nothing
+   int button_code[32];
+   // bits with a button_code
+   uint32_t key_mask;
+   // EV_ABS code per report axis, -1 drops the axis
+   int axis_code[6];
+   // calibrated level that presses the axis' button bit, 256 never does
+   int axis_threshold[6];
+   // the axes that have one
+   int threshold_count;
+   uint8_t threshold_axis[6];
+   // held together, these buttons send their combo's bit instead
+   int combo_count;
+   uint32_t combo_mask[MAX_COMBOS];
+   int button_axis_count;
+   struct button_axis button_axes[MAX_BUTTON_AXES];
+   // the load it's part of
+   struct port_map_set *set;
+};
+
+// one load of the profile. A replaced one is freed once no port holds any
+// of its maps, and only a while after it was replaced, for a decoder that
+// just picked it up and hasn't taken hold of it yet
+struct port_map_set
+{
+   struct port_map maps[MAX_PORTS];
+   // ports holding one of the maps
+   int refs;
+   int64_t retired;
+   struct port_map_set *next;
+};
+
+enum ff_state
+{
+   FF_IDLE,
+   FF_WAITING,
+   FF_PLAYING,
+};
+
+struct ports;
+struct adapter;
+
+// times are CLOCK_MONOTONIC nanoseconds
 struct ff_event
 {
    bool in_use;
    bool forever;
+   enum ff_state state;
    int duration;
    int delay;
+   // plays left, including the current one
    int repetitions;
-   struct timespec start_time;
-   struct timespec end_time;
+   int64_t start_time;
+   int64_t end_time;
+   // next start or stop, while the effect sits in its adapter's ff_heap
+   int64_t deadline;
+   int heap_index;
+   struct ports *port;
+   // magnitude, waveform and envelope for rumble synthesis
+   struct ff_effect effect;
+};
+
+struct watch
+{
+   int fd;
+   void (*handler)(struct watch *w, uint32_t events);
+   void *data;
+   struct watch *next;
 };
 
 struct ports
 {
+   int index;
+   // slot * 4 + index, what calibrations and profiles go by
+   int number;
+   // the uinput device exists; while detached it has no controller behind it
    bool connected;
+   bool detached;
+   // when a detached device is destroyed, INT64_MAX keeps it
+   int64_t detach_deadline;
    bool extra_power;
+   // the uinput or uhid fd
    int uinput;
    unsigned char type;
-   uint16_t buttons;
+   // the profile the device was created with and the state it last sent
+   const struct port_map *map;
+   uint32_t buttons;
    uint8_t axis[6];
-   struct ff_event ff_events[MAX_FF_EVENTS];
+   // the report's buttons before the profile maps them, for --shm
+   uint16_t report_buttons;
+   // direction of each axis' last sent move, for the jitter filter
+   int8_t axis_dir[6];
+   // earliest time an axis-only frame may go out with --emit rate
+   int64_t next_axis_frame;
+   // axis changes are being held back, decode again on the next report
+   bool held;
+   // frames written and frames the emission policy held back or dropped;
+   // only the I/O thread writes them, dump_stats remembers what it printed
+   uint64_t frames;
+   uint64_t frames_suppressed;
+   uint64_t frames_dumped;
+   uint64_t suppressed_dumped;
+   // input events written and writes that failed, for the control socket
+   uint64_t events;
+   uint64_t write_errors;
+   struct adapter *adapter;
+   struct ff_event *ff_events;
+   // effects currently between their start and stop deadlines
+   int ff_playing;
+   // FF_GAIN, 0 - 0xffff
+   int ff_gain;
+   // rumble level last set through the uhid output report, 0 - 255
+   int hid_rumble;
+   // summed effect level and sigma-delta state of the PWM synthesis
+   int32_t ff_level;
+   int32_t pwm_acc;
+   bool pwm_on;
+   // longest time an effect upload sat in the uinput queue, in microseconds
+   long ff_upload_wait_max;
+   // only registered in single-thread mode
+   struct watch ff_watch;
+   // events decoded since the last flush, written with a single write()
+   int pending_count;
+   struct input_event pending[PORT_EVENT_BUFFER];
+};
+
+enum metric
+{
+   // time between consecutive IN transfer completions
+   METRIC_INTERVAL,
+   // IN transfer completion until the last uinput write() for it returned
+   METRIC_LATENCY,
+   // one uinput write() syscall
+   METRIC_WRITE,
+   // rumble OUT transfer submit until its completion
+   METRIC_RUMBLE_RTT,
+   // an effect upload from uinput queueing it until it's handled
+   METRIC_FF_UPLOAD,
+   METRIC_COUNT,
+};
+
+const char *METRIC_NAMES[METRIC_COUNT] = { "interval", "latency", "write", "rumble_rtt", "ff_upload" };
+
+struct sample
+{
+   uint32_t metric;
+   uint32_t ns;
+};
+
+// single producer, single consumer; the producer only writes tail and the
+// consumer only writes head
+struct sample_ring
+{
+   unsigned head;
+   unsigned tail;
+   unsigned dropped;
+   struct sample samples[SAMPLE_RING_SIZE];
+};
+
+struct histogram
+{
+   uint64_t count;
+   uint32_t max;
+   uint64_t buckets[HIST_BUCKETS];
+};
+
+enum capture_kind
+{
+   CAPTURE_REPORT,
+   CAPTURE_RUMBLE,
+   // only passed to the writer when an adapter gives its id back, never
+   // written to the file
+   CAPTURE_CLOSE,
+};
+
+// fixed 64 byte records so captures can be mmapped and indexed directly
+struct capture_header
+{
+   char magic[8];
+   uint32_t version;
+   uint32_t record_size;
+   unsigned char reserved[CAPTURE_RECORD_SIZE - 16];
 };
 
+struct capture_record
+{
+   // monotonic time of the first report in the run
+   int64_t time;
+   // time from the first to the last report in the run
+   uint32_t span;
+   // identical reports that followed the first one, only the writer thread
+   // collapses runs so the hot path just copies
+   uint16_t repeats;
+   uint8_t adapter;
+   uint8_t kind;
+   uint8_t size;
+   unsigned char data[REPORT_SIZE];
+   unsigned char reserved[CAPTURE_RECORD_SIZE - 17 - REPORT_SIZE];
+};
+
+// single producer ring like sample_ring, emptied by the capture writer
+struct capture_ring
+{
+   unsigned head;
+   unsigned tail;
+   struct capture_record records[CAPTURE_RING_SIZE];
+};
+
+// reports come from the transport and rumble packets from whoever holds
+// rumble_lock, so each gets its own ring and neither needs a lock
+struct capture_stream
+{
+   struct capture_ring reports;
+   struct capture_ring rumble;
+};
+
+struct report
+{
+   int size;
+   int64_t time;
+   unsigned char data[REPORT_SIZE];
+};
+
+enum transfer_result
+{
+   TRANSFER_OK,
+   TRANSFER_CANCELLED,
+   TRANSFER_FAILED,
+};
+
+// transfer errors an adapter recovers from, counted per kind
+enum transfer_error
+{
+   ERROR_TIMEOUT,
+   ERROR_STALL,
+   ERROR_OVERFLOW,
+   ERROR_IO,
+   ERROR_SUBMIT,
+   ERROR_KINDS,
+};
+
+static const char *ERROR_NAMES[ERROR_KINDS] = { "timeout", "stall", "overflow", "io", "submit" };
+
+enum recovery_state
+{
+   RECOVERY_NONE,
+   // transfers are being cancelled, the next attempt is due at recovery_due
+   RECOVERY_WAIT,
+   // the hotplug worker is running the transport's recover()
+   RECOVERY_BUSY,
+   // started again, waiting for the first report
+   RECOVERY_RESTARTED,
+};
+
+// where an adapter's reports come from and its rumble packets go to
+struct transport
+{
+   const char *name;
+   // send the init command and start feeding reports to adapter_report()
+   bool (*start)(struct adapter *a);
+   // send rumble_buffer asynchronously, finishing with rumble_done()
+   bool (*write_rumble)(struct adapter *a);
+   // cancel everything in flight, called from the main loop
+   void (*stop)(struct adapter *a);
+   // whether nothing is in flight anymore
+   bool (*idle)(struct adapter *a);
+   void (*close)(struct adapter *a);
+   // on the hotplug worker once a failed adapter is idle, get the device
+   // working again before start() is called; escalates with the attempt
+   bool (*recover)(struct adapter *a, int attempt);
+};
+
+struct synthetic;
+
+enum hotplug_job
+{
+   JOB_OPEN,
+   JOB_CLOSE,
+   JOB_RECOVER,
+};
+
+struct io_thread;
+
 struct adapter
 {
    volatile bool quitting;
+   char name[32];
+   const struct transport *transport;
+   // its ports are numbered slot*4+1 to slot*4+4
+   int slot;
+   // position in adapter_list
+   int list_index;
+   // the I/O thread servicing the adapter, NULL in single-thread mode
+   struct io_thread *io;
+   // set by the I/O thread once it no longer touches the adapter
+   bool released;
+   // identifies the adapter's records in a capture, -1 when not recording
+   int capture_id;
+   struct capture_stream *capture;
+   // slot group in the shared memory segment, -1 without one
+   int shm_index;
+   uint64_t report_seq;
+   // completed IN reports, filled on the libusb event thread and drained by
+   // the I/O thread, which sleeps in poll() on its wake_fd and the uinput
+   // fds so force feedback requests are only read when there are some
+   pthread_mutex_t queue_lock;
+   int wake_fd;
+   bool thread_sleeping;
+   unsigned queue_head;
+   unsigned queue_tail;
+   unsigned queue_dropped;
+   struct report queue[REPORT_QUEUE_SIZE];
+   // libusb transport; transfers are only submitted and reaped on the libusb
+   // event thread, so transfers_pending needs no locking
    struct libusb_device *device;
    struct libusb_device_handle *handle;
-   pthread_t thread;
+   int transfers_pending;
+   unsigned char init_payload[1];
+   struct libusb_transfer *init_transfer;
+   struct libusb_transfer *in_transfers[MAX_IN_TRANSFERS];
+   unsigned char in_buffers[MAX_IN_TRANSFERS][REPORT_SIZE];
+   // last rumble state produced by the I/O thread
    unsigned char rumble[5];
+   // previous report, ports whose 9 bytes didn't change are skipped
+   unsigned char last_report[REPORT_SIZE];
+   // ports to decode on the next report even if unchanged
+   unsigned resync;
+   // latency samples from the decoding thread and the libusb event thread,
+   // folded into histograms by the main loop
+   struct sample_ring proc_samples;
+   struct sample_ring usb_samples;
+   // syscalls spent moving reports in and events out, relaxed atomics read
+   // and reset by dump_stats
+   uint64_t syscalls;
+   // reports processed, reports dropped for their size or id and rumble
+   // packets sent since the adapter was found; written with count_add(),
+   // dump_stats remembers how many reports it printed
+   uint64_t reports;
+   uint64_t reports_invalid;
+   uint64_t rumble_packets;
+   uint64_t reports_dumped;
+   struct histogram histograms[METRIC_COUNT];
+   int64_t last_report_time;
+   int64_t rumble_submit_time;
+   // min-heap of scheduled effects on all ports, keyed on deadline
+   struct ff_event **ff_heap;
+   int ff_heap_size;
+   // wakes the event loop for the next deadline in single-thread mode
+   int ff_timer;
+   int64_t ff_timer_armed;
+   struct watch ff_timer_watch;
+   // set when an effect starts, stops or changes so levels are recomputed
+   bool ff_changed;
+   // next PWM step, INT64_MAX while no port is rumbling
+   int64_t pwm_next;
+   // without PWM, when an envelope next takes an effect to or from zero
+   int64_t level_next;
+   // rumble writes are asynchronous; while one is in flight only the newest
+   // pending state is kept, older ones are never sent
+   pthread_mutex_t rumble_lock;
+   bool rumble_in_flight;
+   bool rumble_queued;
+   // no writes while the adapter recovers, the newest state goes out after
+   bool rumble_paused;
+   // a write failed to submit, the main loop starts a recovery for it
+   bool rumble_failed;
+   unsigned char rumble_next[5];
+   unsigned char rumble_buffer[5];
+   struct libusb_transfer *rumble_transfer;
+   // synthetic transport
+   struct synthetic *synthetic;
+   // set once the interface is claimed, so close knows to release it
+   bool claimed;
+   // hotplug worker job, and what became of a JOB_OPEN or JOB_RECOVER
+   enum hotplug_job job;
+   bool open_failed;
+   bool open_cancelled;
+   bool recover_failed;
+   // transfer errors and the recovery from them, main thread only
+   uint64_t errors[ERROR_KINDS];
+   enum recovery_state recovery;
+   int recovery_attempt;
+   int64_t recovery_start;
+   int64_t recovery_due;
+   unsigned recoveries;
+   int64_t recovery_max;
+   // keep the virtual devices for a quick replug instead of destroying them
+   bool parking;
+   // found at startup and hasn't sent a report yet
+   bool startup;
+   struct adapter *job_next;
    struct ports controllers[4];
    struct adapter *next;
 };
 
+// decodes reports and reads force feedback requests for a share of the
+// adapters, so dozens of them don't need a thread each
+struct io_thread
+{
+   pthread_t thread;
+   // shared by the adapters, any of them with a new report writes to it
+   int wake_fd;
+   pthread_mutex_t lock;
+   // signalled when the thread lets go of a quitting adapter
+   pthread_cond_t released;
+   bool stopping;
+   int adapter_count;
+   struct adapter *adapters[MAX_ADAPTERS];
+};
+
+struct control_client
+{
+   struct watch watch;
+   char in[CONTROL_LINE_SIZE];
+   size_t in_len;
+   // answers not yet taken by the client, EPOLLOUT is watched meanwhile
+   char *out;
+   size_t out_len;
+   size_t out_sent;
+   bool waiting;
+};
+
+// FIFO of adapters linked through job_next
+struct adapter_queue
+{
+   struct adapter *head;
+   struct adapter *tail;
+};
+
+// virtual devices of an unplugged adapter, waiting for it to come back on
+// the same physical port
+struct parked_ports
+{
+   char name[32];
+   int64_t expires;
+   struct ports ports[4];
+   struct parked_ports *next;
+};
+
 static bool raw_mode;
 
+// what the virtual controllers are made with
+enum output_mode
+{
+   OUTPUT_UINPUT,
+   OUTPUT_UHID,
+   OUTPUT_MODES,
+};
+
+static const char *OUTPUT_MODE_NAMES[OUTPUT_MODES] = { "uinput", "uhid" };
+
+static enum output_mode output_mode;
+
+// motors stay off while false, switched from the control socket
+static bool rumble_enabled = true;
+
+// when a decoded change becomes an input frame
+enum emit_mode
+{
+   // every change right away
+   EMIT_LATENCY,
+   // button changes right away, axis-only changes at most emit_rate_hz
+   EMIT_RATE,
+   // single step axis noise dropped
+   EMIT_JITTER,
+};
+
+static const char *EMIT_MODE_NAMES[] = { "latency", "rate", "jitter" };
+
+static enum emit_mode emit_mode;
+static int emit_rate_hz = DEFAULT_EMIT_RATE;
+
+static const char *calibration_path;
+
+// indexed by port number on the adapter
+static struct port_calibration calibrations[MAX_PORTS];
+
+static struct port_luts port_luts[MAX_PORTS];
+
+static const char *profile_path;
+
+// current profile per port, swapped atomically on SIGHUP
+static const struct port_map *port_maps[MAX_PORTS];
+static struct port_map_set *port_map_sets;
+
+static volatile sig_atomic_t reload_requested;
+
+static bool verbose;
+
+static bool single_thread;
+
+// SCHED_FIFO/SCHED_RR priority for the I/O threads, 0 leaves them on CFS
+static int rt_priority;
+static int rt_policy = SCHED_FIFO;
+static cpu_set_t rt_cpus;
+static const char *rt_cpu_list;
+static bool rt_mlock;
+// /dev/cpu_dma_latency request in microseconds, -1 leaves it alone
+static int dma_latency = -1;
+static int dma_latency_fd = -1;
+
+static int epoll_fd = -1;
+
+// shared by every libusb pollfd, they all just mean "call libusb"
+static struct watch usb_watch;
+
+static bool usb_events_ready;
+
 static volatile int quitting;
 
-static struct adapter adapters;
+static volatile sig_atomic_t stats_requested;
+
+// seconds between automatic stats dumps, 0 only dumps on SIGUSR1
+static int stats_interval;
+
+// running adapters, main thread only; removal moves the last one into the
+// hole, so walking them is a plain loop over a dense array
+static struct adapter *adapter_list[MAX_ADAPTERS];
+static int adapter_count;
+
+// location each slot was last used by, so an adapter plugged back into the
+// same USB port gets the same port numbers; pinned with --slots
+static char slot_locations[MAX_ADAPTERS][32];
+static bool slot_used[MAX_ADAPTERS];
+
+// 0 starts one per online CPU the I/O threads may run on
+static int io_thread_max;
+static int io_thread_count;
+static struct io_thread *io_threads;
+
+// adapters that were removed but still have transfers in flight; changed
+// on the main thread with hotplug_lock held, so the workers can check it
+static struct adapter *dying_adapters;
+
+// USB adapters the hotplug worker is opening, main thread only
+static struct adapter *opening_adapters;
+
+// opening and closing devices can block for a long time, so it's done on
+// worker threads that report finished opens back through hotplug_watch,
+// which also wakes the main loop for failed rumble writes
+static pthread_t hotplug_threads[HOTPLUG_WORKERS];
+static int hotplug_worker_count;
+static pthread_mutex_t hotplug_lock;
+static pthread_cond_t hotplug_cond;
+static bool hotplug_stopping;
+static struct adapter_queue hotplug_jobs;
+static struct adapter_queue hotplug_opened;
+// finished jobs not handed to the main loop yet, opens stay here while the
+// adapter's old self at the same location is still being closed
+static struct adapter *hotplug_finished;
+// location of the adapter each worker is closing
+static char hotplug_closing[HOTPLUG_WORKERS][32];
+static struct parked_ports *parked_ports;
+static struct watch hotplug_watch;
+
+// wakes the main loop when an adapter's next recovery attempt is due
+static struct watch recovery_watch;
+static int64_t recovery_timer_armed = INT64_MAX;
+
+// time from startup to the first report and to every adapter found at
+// startup reporting; the ones still to report, main thread only
+static int64_t startup_time;
+static bool startup_scanning;
+static int startup_adapters;
+static int startup_pending;
+static int startup_reporting;
+
+// 0 destroys the virtual devices of an unplugged adapter right away
+static int replug_grace_msec = DEFAULT_REPLUG_GRACE_MSEC;
+
+// milliseconds a port's virtual device outlives its controller, so a
+// WaveBird losing signal doesn't make games re-enumerate; 0 destroys it
+static int port_grace_msec;
+
+// create all four devices up front and never destroy them with the adapter
+// still there
+static bool precreate_ports;
+
+static int num_in_transfers = DEFAULT_IN_TRANSFERS;
+
+static int ff_effects_max = DEFAULT_FF_EFFECTS;
+
+// 0 keeps the motor fully on while any effect plays
+static int rumble_pwm_hz;
 
 static const char *uinput_path;
+static const char *uhid_path;
 
 static uint16_t vendor_id = USB_ID_VENDOR;
 
 static uint16_t product_id = USB_ID_PRODUCT;
 
+// synthetic adapters replace USB ones when non-zero
+static int synthetic_count;
+
+static int synthetic_rate = DEFAULT_SYNTHETIC_RATE;
+
+// seconds between random arrive/leave and plug/unplug events, 0 disables
+static int synthetic_churn;
+
+// reports per 1000 that fail with a random transfer error instead
+static int synthetic_faults;
+
+// raw reports replayed by the synthetic adapters instead of generated ones
+static const char *synthetic_path;
+static unsigned char *synthetic_reports;
+static size_t synthetic_report_count;
+
+static FILE *capture_file;
+static pthread_t capture_thread;
+// wakes the writer before its next poll when a ring fills up or on exit
+static int capture_wake_fd = -1;
+static bool capture_stopping;
+static unsigned capture_dropped;
+// allocated the first time an id is handed out and kept until the writer
+// is done, so it never looks at an adapter that's gone
+static struct capture_stream *capture_streams[CAPTURE_IDS];
+static bool capture_ids_used[CAPTURE_IDS];
+
+static const char *replay_path;
+// ignore the recorded timing and feed reports as fast as they're consumed
+static bool replay_fast;
+static const struct capture_record *replay_records;
+static size_t replay_record_count, replay_map_size;
+static struct watch replay_watch;
+
+static const char *capture_path;
+
+static const char *shm_path;
+
+// published controller state, NULL unless --shm is given
+static struct gc_shm *shm;
+static char shm_name[64];
+static bool shm_groups_used[GC_SHM_ADAPTERS];
+
+static const char *control_path;
+static struct watch control_watch;
+static struct control_client control_clients[MAX_CONTROL_CLIENTS];
+
+static bool bench_mode;
+
+// keeps benchmark results alive so the compiler can't drop the work
+static volatile uint64_t bench_sink;
+
+static int synthetic_next_id;
+static uint32_t synthetic_seed = 0x9e3779b9;
+static int64_t synthetic_next_churn;
+static struct watch synthetic_watch;
+
+static int64_t monotonic_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// where every timestamp comes from; the force feedback simulation in the
+// bench swaps in a virtual clock so hours of effects run in seconds
+static int64_t (*clock_source)(void) = monotonic_ns;
+
+static int64_t now_ns(void)
+{
+   return clock_source();
+}
+
+// the signal handlers only raise flags for the main loop, so the helper
+// threads keep them blocked and the main loop's epoll_wait() is the one
+// they interrupt
+static int start_thread(pthread_t *thread, void *(*run)(void *), void *arg)
+{
+   sigset_t block, saved;
+   sigemptyset(&block);
+   sigaddset(&block, SIGINT);
+   sigaddset(&block, SIGTERM);
+   sigaddset(&block, SIGUSR1);
+   sigaddset(&block, SIGHUP);
+   pthread_sigmask(SIG_BLOCK, &block, &saved);
+   int ret = pthread_create(thread, NULL, run, arg);
+   pthread_sigmask(SIG_SETMASK, &saved, NULL);
+   return ret;
+}
+
 static unsigned char connected_type(unsigned char status)
 {
    unsigned char type = status & (STATE_NORMAL | STATE_WAVEBIRD);
@@ -123,476 +1053,6049 @@ static unsigned char connected_type(unsigned char status)
    }
 }
 
-static bool uinput_create(int i, struct ports *port, unsigned char type)
+static bool centered_axis(int j)
 {
-   fprintf(stderr, "connecting on port %d\n", i);
-   struct uinput_user_dev uinput_dev;
-   memset(&uinput_dev, 0, sizeof(uinput_dev));
-   port->uinput = open(uinput_path, O_RDWR | O_NONBLOCK);
+   return AXIS_OFFSET_VALUES[j] != ABS_Z && AXIS_OFFSET_VALUES[j] != ABS_RZ;
+}
 
-   // buttons
-   ioctl(port->uinput, UI_SET_EVBIT, EV_KEY);
-   ioctl(port->uinput, UI_SET_KEYBIT, BTN_NORTH);
-   ioctl(port->uinput, UI_SET_KEYBIT, BTN_SOUTH);
-   ioctl(port->uinput, UI_SET_KEYBIT, BTN_EAST);
-   ioctl(port->uinput, UI_SET_KEYBIT, BTN_WEST);
-   ioctl(port->uinput, UI_SET_KEYBIT, BTN_START);
-   ioctl(port->uinput, UI_SET_KEYBIT, BTN_DPAD_UP);
-   ioctl(port->uinput, UI_SET_KEYBIT, BTN_DPAD_DOWN);
-   ioctl(port->uinput, UI_SET_KEYBIT, BTN_DPAD_LEFT);
-   ioctl(port->uinput, UI_SET_KEYBIT, BTN_DPAD_RIGHT);
-   ioctl(port->uinput, UI_SET_KEYBIT, BTN_TL);
-   ioctl(port->uinput, UI_SET_KEYBIT, BTN_TR);
-   ioctl(port->uinput, UI_SET_KEYBIT, BTN_TR2);
-
-   // axis
-   ioctl(port->uinput, UI_SET_EVBIT, EV_ABS);
-   ioctl(port->uinput, UI_SET_ABSBIT, ABS_X);
-   ioctl(port->uinput, UI_SET_ABSBIT, ABS_Y);
-   ioctl(port->uinput, UI_SET_ABSBIT, ABS_RX);
-   ioctl(port->uinput, UI_SET_ABSBIT, ABS_RY);
-   ioctl(port->uinput, UI_SET_ABSBIT, ABS_Z);
-   ioctl(port->uinput, UI_SET_ABSBIT, ABS_RZ);
-
-   if (raw_mode)
-   {
-      uinput_dev.absmin[ABS_X]  = 0;  uinput_dev.absmax[ABS_X]  = 255;
-      uinput_dev.absmin[ABS_Y]  = 0;  uinput_dev.absmax[ABS_Y]  = 255;
-      uinput_dev.absmin[ABS_RX] = 0;  uinput_dev.absmax[ABS_RX] = 255;
-      uinput_dev.absmin[ABS_RY] = 0;  uinput_dev.absmax[ABS_RY] = 255;
-      uinput_dev.absmin[ABS_Z]  = 0;  uinput_dev.absmax[ABS_Z]  = 255;
-      uinput_dev.absmin[ABS_RZ] = 0;  uinput_dev.absmax[ABS_RZ] = 255;
-   }
-   else
+static bool flipped_axis(int j)
+{
+   // flip from 0 - 255 to 255 - 0
+   return AXIS_OFFSET_VALUES[j] == ABS_Y || AXIS_OFFSET_VALUES[j] == ABS_RY;
+}
+
+// map a raw reading through a calibration to 0 - 255, before flipping
+static int calibrate_value(const struct axis_calibration *c, int raw, bool centered)
+{
+   double n;
+   if (centered)
    {
-      uinput_dev.absmin[ABS_X]  = 20; uinput_dev.absmax[ABS_X]  = 235;
-      uinput_dev.absmin[ABS_Y]  = 20; uinput_dev.absmax[ABS_Y]  = 235;
-      uinput_dev.absmin[ABS_RX] = 30; uinput_dev.absmax[ABS_RX] = 225;
-      uinput_dev.absmin[ABS_RY] = 30; uinput_dev.absmax[ABS_RY] = 225;
-      uinput_dev.absmin[ABS_Z]  = 25; uinput_dev.absmax[ABS_Z]  = 225;
-      uinput_dev.absmin[ABS_RZ] = 25; uinput_dev.absmax[ABS_RZ] = 225;
+      int d = raw - c->center;
+      int half = d < 0 ? c->center - c->min : c->max - c->center;
+      if (abs(d) <= c->deadzone || half <= c->deadzone)
+         return 128;
+      n = (double)(abs(d) - c->deadzone) / (half - c->deadzone);
+      n = pow(n > 1.0 ? 1.0 : n, c->curve);
+      return d < 0 ? (int)lround(128 - n * 127) : (int)lround(128 + n * 127);
    }
 
-   // rumble
-   ioctl(port->uinput, UI_SET_EVBIT, EV_FF);
-   ioctl(port->uinput, UI_SET_FFBIT, FF_PERIODIC);
-   ioctl(port->uinput, UI_SET_FFBIT, FF_SQUARE);
-   ioctl(port->uinput, UI_SET_FFBIT, FF_TRIANGLE);
-   ioctl(port->uinput, UI_SET_FFBIT, FF_SINE);
-   ioctl(port->uinput, UI_SET_FFBIT, FF_RUMBLE);
-   uinput_dev.ff_effects_max = MAX_FF_EVENTS;
-
-   snprintf(uinput_dev.name, sizeof(uinput_dev.name), "Wii U GameCube Adapter Port %d", i+1);
-   uinput_dev.name[sizeof(uinput_dev.name)-1] = 0;
-   uinput_dev.id.bustype = BUS_USB;
-   uinput_dev.id.vendor = vendor_id;
-   uinput_dev.id.product = product_id;
+   int d = raw - c->min;
+   int range = c->max - c->min;
+   if (d <= c->deadzone || range <= c->deadzone)
+      return 0;
+   n = (double)(d - c->deadzone) / (range - c->deadzone);
+   n = pow(n > 1.0 ? 1.0 : n, c->curve);
+   return (int)lround(n * 255);
+}
 
-   size_t to_write = sizeof(uinput_dev);
-   size_t written = 0;
-   while (written < to_write)
+static void compile_calibration(const struct port_calibration *cal, struct port_luts *luts)
+{
+   for (int j = 0; j < 6; j++)
    {
-      ssize_t write_ret = write(port->uinput, (const char*)&uinput_dev + written, to_write - written);
-      if (write_ret < 0)
+      const struct axis_calibration *c = &cal->axes[j];
+      int lo = 255, hi = 0;
+
+      for (int raw = 0; raw < 256; raw++)
       {
-         perror("error writing uinput device settings");
-         close(port->uinput);
-         return false;
+         int value = raw;
+         if (c->set)
+         {
+            value = calibrate_value(c, raw, centered_axis(j));
+            // calibrated sticks span 1 - 255, mirror them around 128
+            if (flipped_axis(j))
+               value = 256 - value;
+         }
+         else if (flipped_axis(j))
+         {
+            value ^= 0xFF;
+         }
+         luts->lut[j][raw] = value;
+         lo = value < lo ? value : lo;
+         hi = value > hi ? value : hi;
+      }
+      // calibrated sticks center on 128 and raw ones are taken to, triggers
+      // rest at their lowest
+      luts->rest[j] = centered_axis(j) ? 128 : lo;
+
+      if (c->set)
+      {
+         // the deadzone is already applied here, so consumers get no flat
+         luts->absmin[j] = lo;
+         luts->absmax[j] = hi;
+         luts->absfuzz[j] = c->fuzz;
+         luts->absflat[j] = 0;
+      }
+      else
+      {
+         luts->absmin[j] = DEFAULT_AXIS_RANGES[j][0];
+         luts->absmax[j] = DEFAULT_AXIS_RANGES[j][1];
+         luts->absfuzz[j] = 0;
+         luts->absflat[j] = 0;
       }
-      written += write_ret;
    }
 
-   if (ioctl(port->uinput, UI_DEV_CREATE) != 0)
+   for (int s = 0; s < 2; s++)
    {
-      perror("error creating uinput device");
-      close(port->uinput);
-      return false;
+      luts->radial_sq[s] = cal->radial[s] * cal->radial[s];
+      luts->threshold[s] = cal->threshold[s] > 0 ? cal->threshold[s] : 256;
    }
-   port->type = type;
-   port->connected = true;
-   return true;
 }
 
-static void uinput_destroy(int i, struct ports *port)
+static void compile_calibrations(void)
 {
-   fprintf(stderr, "disconnecting on port %d\n", i);
-   ioctl(port->uinput, UI_DEV_DESTROY);
-   close(port->uinput);
-   port->connected = false;
+   for (int i = 0; i < MAX_PORTS; i++)
+      compile_calibration(&calibrations[i], &port_luts[i]);
 }
 
-static struct timespec ts_add(struct timespec *start, int milliseconds)
+static bool parse_calibration_key(struct port_calibration *cal, int axis, int stick, const char *key, const char *value)
 {
-   struct timespec ret = *start;
-   int s = milliseconds / 1000;
-   int ns = (milliseconds % 1000) * 1000000;
-   ret.tv_sec += s ;
-   ret.tv_nsec += ns ;
-   if (ret.tv_nsec >= 1000000000L)
+   char *end = NULL;
+   double d = strtod(value, &end);
+   if (*value == '\0' || *end != '\0')
+      return false;
+
+   if (stick >= 0)
+   {
+      if (strcmp(key, "radial") != 0 || d < 0 || d > 127)
+         return false;
+      cal->radial[stick] = (int)d;
+      return true;
+   }
+
+   struct axis_calibration *c = &cal->axes[axis];
+   if (!c->set)
+   {
+      c->set = true;
+      c->center = 128;
+      c->min = 0;
+      c->max = 255;
+      c->curve = 1.0;
+   }
+
+   if (strcmp(key, "curve") == 0)
+   {
+      if (d <= 0)
+         return false;
+      c->curve = d;
+      return true;
+   }
+   if (d < 0 || d > 255)
+      return false;
+   if (strcmp(key, "center") == 0)
+      c->center = (int)d;
+   else if (strcmp(key, "min") == 0)
+      c->min = (int)d;
+   else if (strcmp(key, "max") == 0)
+      c->max = (int)d;
+   else if (strcmp(key, "deadzone") == 0)
+      c->deadzone = (int)d;
+   else if (strcmp(key, "fuzz") == 0)
+      c->fuzz = (int)d;
+   else if (strcmp(key, "threshold") == 0 && !centered_axis(axis))
+      cal->threshold[axis - 4] = (int)d;
+   else
+      return false;
+   return true;
+}
+
+// lines look like "<port|*> <axis> key=value ...", see README.md
+static bool load_calibration(const char *path)
+{
+   FILE *f = fopen(path, "r");
+   if (f == NULL)
+   {
+      perror(path);
+      return false;
+   }
+
+   char line[512];
+   int line_number = 0;
+   bool ok = true;
+   while (ok && fgets(line, sizeof(line), f) != NULL)
+   {
+      line_number++;
+      char *comment = strchr(line, '#');
+      if (comment != NULL)
+         *comment = '\0';
+
+      char *save = NULL;
+      char *port_str = strtok_r(line, " \t\r\n", &save);
+      if (port_str == NULL)
+         continue;
+      char *axis_str = strtok_r(NULL, " \t\r\n", &save);
+
+      int first = 0, last = MAX_PORTS - 1;
+      if (strcmp(port_str, "*") != 0)
+      {
+         first = last = atoi(port_str) - 1;
+         if (first < 0 || first >= MAX_PORTS)
+            ok = false;
+      }
+
+      int axis = -1, stick = -1;
+      for (int j = 0; axis_str != NULL && j < 6; j++)
+      {
+         if (strcmp(axis_str, AXIS_NAMES[j]) == 0)
+            axis = j;
+      }
+      if (axis_str != NULL && strcmp(axis_str, "main") == 0)
+         stick = 0;
+      else if (axis_str != NULL && strcmp(axis_str, "c") == 0)
+         stick = 1;
+      if (axis < 0 && stick < 0)
+         ok = false;
+
+      char *pair;
+      while (ok && (pair = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+      {
+         char *eq = strchr(pair, '=');
+         if (eq == NULL)
+         {
+            ok = false;
+            break;
+         }
+         *eq = '\0';
+         for (int i = first; i <= last && ok; i++)
+            ok = parse_calibration_key(&calibrations[i], axis, stick, pair, eq + 1);
+      }
+   }
+   fclose(f);
+
+   if (!ok)
+      fprintf(stderr, "%s:%d: invalid calibration line\n", path, line_number);
+   return ok;
+}
+
+static void default_port_map(struct port_map *map)
+{
+   map->caps.vendor = vendor_id;
+   map->caps.product = product_id;
+   map->caps.raw = raw_mode;
+   for (int j = 0; j < 32; j++)
+      map->button_code[j] = j < 16 ? BUTTON_OFFSET_VALUES[j] : -1;
+   for (int j = 0; j < 6; j++)
+   {
+      map->axis_code[j] = AXIS_OFFSET_VALUES[j];
+      map->axis_threshold[j] = 256;
+   }
+}
+
+static int find_name(const char **names, int count, const char *name)
+{
+   for (int j = 0; j < count; j++)
+   {
+      if (names[j] != NULL && strcmp(names[j], name) == 0)
+         return j;
+   }
+   return -1;
+}
+
+static const struct code_name *find_code(const char *name)
+{
+   for (size_t k = 0; k < sizeof(CODE_NAMES) / sizeof(CODE_NAMES[0]); k++)
+   {
+      if (strcmp(CODE_NAMES[k].name, name) == 0)
+         return &CODE_NAMES[k];
+   }
+   return NULL;
+}
+
+static bool parse_int(const char *str, int min, int max, int base, int *value)
+{
+   char *end = NULL;
+   long l = strtol(str, &end, base);
+   if (*str == '\0' || *end != '\0' || l < min || l > max)
+      return false;
+   *value = (int)l;
+   return true;
+}
+
+// a button that's mapped again stops driving the axes it drove
+static void unmap_button_axes(struct port_map *map, int bit)
+{
+   for (int k = 0; k < map->button_axis_count; k++)
+   {
+      struct button_axis *ba = &map->button_axes[k];
+      int kept = 0;
+      for (int t = 0; t < ba->term_count; t++)
+      {
+         if (ba->bit[t] == bit)
+            continue;
+         ba->bit[kept] = ba->bit[t];
+         ba->value[kept] = ba->value[t];
+         kept++;
+      }
+      ba->term_count = kept;
+      ba->mask &= ~(1u << bit);
+   }
+}
+
+static bool map_button_axis(struct port_map *map, int bit, int code, int value)
+{
+   struct button_axis *ba = NULL;
+   for (int k = 0; k < map->button_axis_count; k++)
+   {
+      if (map->button_axes[k].code == code)
+         ba = &map->button_axes[k];
+   }
+   if (ba == NULL)
+   {
+      if (map->button_axis_count == MAX_BUTTON_AXES)
+         return false;
+      ba = &map->button_axes[map->button_axis_count++];
+      ba->code = code;
+   }
+   if (ba->term_count == MAX_AXIS_TERMS)
+      return false;
+   ba->bit[ba->term_count] = bit;
+   ba->value[ba->term_count] = value;
+   ba->term_count++;
+   ba->mask |= 1u << bit;
+   return true;
+}
+
+// one profile line for one port: kind, then up to three arguments
+static bool parse_profile_line(struct port_map *map, const char *kind, char **args)
+{
+   if (kind == NULL || args[0] == NULL)
+      return false;
+
+   if (strcmp(kind, "id") == 0)
+   {
+      int vendor, product;
+      if (args[1] == NULL || args[2] != NULL
+            || !parse_int(args[0], 0, 0xffff, 16, &vendor)
+            || !parse_int(args[1], 0, 0xffff, 16, &product))
+         return false;
+      map->caps.vendor = vendor;
+      map->caps.product = product;
+      return true;
+   }
+
+   bool none = args[1] != NULL && strcmp(args[1], "none") == 0;
+   const struct code_name *target = args[1] != NULL && !none ? find_code(args[1]) : NULL;
+   if (!none && target == NULL)
+      return false;
+
+   if (strcmp(kind, "combo") == 0)
+   {
+      if (none || target->type != EV_KEY || args[2] != NULL || map->combo_count == MAX_COMBOS)
+         return false;
+      // strtok_r would clobber the source shared by the other ports
+      char buttons[64];
+      snprintf(buttons, sizeof(buttons), "%s", args[0]);
+      uint32_t mask = 0;
+      char *save = NULL;
+      for (char *b = strtok_r(buttons, "+", &save); b != NULL; b = strtok_r(NULL, "+", &save))
+      {
+         int j = find_name(BUTTON_NAMES, 16, b);
+         if (j < 0)
+            return false;
+         mask |= 1u << j;
+      }
+      if (__builtin_popcount(mask) < 2)
+         return false;
+      map->combo_mask[map->combo_count] = mask;
+      map->button_code[BIT_COMBO + map->combo_count] = target->code;
+      map->combo_count++;
+      return true;
+   }
+
+   if (strcmp(kind, "button") == 0)
+   {
+      int j = find_name(BUTTON_NAMES, 16, args[0]);
+      if (j < 0)
+         return false;
+      unmap_button_axes(map, j);
+      map->button_code[j] = -1;
+      if (none || target->type == EV_KEY)
+      {
+         if (!none)
+            map->button_code[j] = target->code;
+         return args[2] == NULL;
+      }
+      // pressing the button adds value to the axis
+      int value;
+      if (args[2] == NULL || !parse_int(args[2], -32767, 32767, 10, &value) || value == 0)
+         return false;
+      return map_button_axis(map, j, target->code, value);
+   }
+
+   if (strcmp(kind, "axis") == 0)
+   {
+      int j = find_name(AXIS_NAMES, 6, args[0]);
+      if (j < 0)
+         return false;
+      if (none || target->type == EV_ABS)
+      {
+         map->axis_code[j] = none ? -1 : target->code;
+         return args[2] == NULL;
+      }
+      // the axis also presses a button past a calibrated level
+      int threshold;
+      if (args[2] == NULL || !parse_int(args[2], 1, 255, 10, &threshold))
+         return false;
+      map->axis_threshold[j] = threshold;
+      map->button_code[BIT_AXIS_BUTTON + j] = target->code;
+      return true;
+   }
+
+   return false;
+}
+
+// derive the device capabilities, false if an axis is driven twice
+static bool finalize_port_map(struct port_map *map)
+{
+   for (int j = 0; j < 32; j++)
+   {
+      int code = map->button_code[j];
+      if (code < 0)
+         continue;
+      map->key_mask |= 1u << j;
+      map->caps.keybits[code / 8] |= 1 << (code % 8);
+   }
+
+   for (int j = 0; j < 6; j++)
+   {
+      if (map->axis_threshold[j] < 256)
+         map->threshold_axis[map->threshold_count++] = j;
+      int code = map->axis_code[j];
+      if (code < 0)
+         continue;
+      if (map->caps.absbits & (1ULL << code))
+         return false;
+      map->caps.absbits |= 1ULL << code;
+   }
+
+   for (int k = 0; k < map->button_axis_count; k++)
+   {
+      const struct button_axis *ba = &map->button_axes[k];
+      if (map->caps.absbits & (1ULL << ba->code))
+         return false;
+      map->caps.absbits |= 1ULL << ba->code;
+      for (int t = 0; t < ba->term_count; t++)
+      {
+         if (ba->value[t] < 0)
+            map->caps.absrange[k][0] += ba->value[t];
+         else
+            map->caps.absrange[k][1] += ba->value[t];
+      }
+   }
+   return true;
+}
+
+// the default layout with the profile at path on top, NULL if it's invalid
+static struct port_map_set *load_profile(const char *path)
+{
+   struct port_map_set *set = calloc(1, sizeof(struct port_map_set));
+   if (set == NULL)
+   {
+      fprintf(stderr, "FATAL: calloc() failed\n");
+      exit(-1);
+   }
+   for (int i = 0; i < MAX_PORTS; i++)
+      default_port_map(&set->maps[i]);
+
+   FILE *f = path != NULL ? fopen(path, "r") : NULL;
+   if (path != NULL && f == NULL)
+   {
+      perror(path);
+      free(set);
+      return NULL;
+   }
+
+   char line[512];
+   int line_number = 0;
+   bool ok = true;
+   while (ok && f != NULL && fgets(line, sizeof(line), f) != NULL)
+   {
+      line_number++;
+      char *comment = strchr(line, '#');
+      if (comment != NULL)
+         *comment = '\0';
+
+      char *save = NULL;
+      char *port_str = strtok_r(line, " \t\r\n", &save);
+      if (port_str == NULL)
+         continue;
+      char *kind = strtok_r(NULL, " \t\r\n", &save);
+
+      int first = 0, last = MAX_PORTS - 1;
+      if (strcmp(port_str, "*") != 0)
+      {
+         first = last = atoi(port_str) - 1;
+         if (first < 0 || first >= MAX_PORTS)
+            ok = false;
+      }
+
+      if (ok && kind != NULL && strcmp(kind, "name") == 0)
+      {
+         // the rest of the line
+         char *name = strtok_r(NULL, "\r\n", &save);
+         while (name != NULL && (*name == ' ' || *name == '\t'))
+            name++;
+         ok = name != NULL && *name != '\0';
+         for (int i = first; i <= last && ok; i++)
+            snprintf(set->maps[i].caps.name, sizeof(set->maps[i].caps.name), "%s", name);
+         continue;
+      }
+
+      char *args[4];
+      for (int k = 0; k < 4; k++)
+         args[k] = strtok_r(NULL, " \t\r\n", &save);
+      ok = ok && args[3] == NULL;
+      for (int i = first; i <= last && ok; i++)
+         ok = parse_profile_line(&set->maps[i], kind, args);
+   }
+   if (f != NULL)
+      fclose(f);
+
+   if (!ok)
+   {
+      fprintf(stderr, "%s:%d: invalid profile line\n", path, line_number);
+      free(set);
+      return NULL;
+   }
+   for (int i = 0; i < MAX_PORTS; i++)
+   {
+      if (!finalize_port_map(&set->maps[i]))
+      {
+         fprintf(stderr, "%s: port %d sends the same axis twice\n", path, i+1);
+         free(set);
+         return NULL;
+      }
+   }
+   return set;
+}
+
+// the decoders pick the maps up on their next report and recreate the
+// devices whose caps changed
+static void install_port_maps(struct port_map_set *set)
+{
+   if (port_map_sets != NULL)
+      port_map_sets->retired = monotonic_ns();
+   set->next = port_map_sets;
+   port_map_sets = set;
+   for (int i = 0; i < MAX_PORTS; i++)
+   {
+      set->maps[i].set = set;
+      __atomic_store_n(&port_maps[i], &set->maps[i], __ATOMIC_RELEASE);
+   }
+}
+
+// a port taking one of the maps, or giving its map up with NULL
+static void set_port_map(struct ports *port, const struct port_map *map)
+{
+   if (map != NULL)
+      __atomic_add_fetch(&map->set->refs, 1, __ATOMIC_RELAXED);
+   if (port->map != NULL)
+      __atomic_sub_fetch(&port->map->set->refs, 1, __ATOMIC_RELEASE);
+   port->map = map;
+}
+
+// free the replaced sets nobody uses anymore
+static void reap_port_maps(void)
+{
+   if (port_map_sets == NULL)
+      return;
+   int64_t now = monotonic_ns();
+   struct port_map_set **p = &port_map_sets->next;
+   while (*p != NULL)
+   {
+      struct port_map_set *set = *p;
+      if (now - set->retired < PORT_MAP_GRACE_MSEC * NSEC_PER_MSEC
+            || __atomic_load_n(&set->refs, __ATOMIC_ACQUIRE) > 0)
+      {
+         p = &set->next;
+         continue;
+      }
+      *p = set->next;
+      free(set);
+   }
+}
+
+// switch to the profile at profile_path, so a bad file or a slow read never
+// holds up input
+static bool install_profile(void)
+{
+   struct port_map_set *set = load_profile(profile_path);
+   if (set == NULL)
+      return false;
+   install_port_maps(set);
+   return true;
+}
+
+// the current maps with the other axis ranges
+static void set_raw_mode(bool raw)
+{
+   if (raw == raw_mode)
+      return;
+   raw_mode = raw;
+   struct port_map_set *set = calloc(1, sizeof(struct port_map_set));
+   if (set == NULL)
+   {
+      fprintf(stderr, "FATAL: calloc() failed\n");
+      exit(-1);
+   }
+   for (int i = 0; i < MAX_PORTS; i++)
+   {
+      set->maps[i] = *port_maps[i];
+      set->maps[i].caps.raw = raw;
+   }
+   install_port_maps(set);
+}
+
+static void free_profiles(void)
+{
+   while (port_map_sets != NULL)
+   {
+      struct port_map_set *next = port_map_sets->next;
+      free(port_map_sets);
+      port_map_sets = next;
+   }
+}
+
+static void sample_push(struct sample_ring *ring, enum metric metric, int64_t ns)
+{
+   unsigned tail = ring->tail;
+   if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= SAMPLE_RING_SIZE)
+   {
+      __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+      return;
+   }
+   struct sample *sample = &ring->samples[tail % SAMPLE_RING_SIZE];
+   sample->metric = metric;
+   sample->ns = ns < 0 ? 0 : ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+   __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void add_syscalls(struct adapter *a, unsigned count)
+{
+   __atomic_fetch_add(&a->syscalls, count, __ATOMIC_RELAXED);
+}
+
+static int hist_bucket(uint32_t value)
+{
+   if (value < HIST_SUB_COUNT)
+      return value;
+   int shift = 31 - __builtin_clz(value) - HIST_SUB_BITS + 1;
+   return shift * HIST_HALF_COUNT + (value >> shift);
+}
+
+// highest value that lands in bucket
+static uint64_t hist_bucket_value(int bucket)
+{
+   if (bucket < HIST_SUB_COUNT)
+      return bucket;
+   int shift = bucket / HIST_HALF_COUNT - 1;
+   uint64_t mantissa = bucket - shift * HIST_HALF_COUNT;
+   return ((mantissa + 1) << shift) - 1;
+}
+
+static void hist_record(struct histogram *h, uint32_t value)
+{
+   h->buckets[hist_bucket(value)]++;
+   h->count++;
+   if (value > h->max)
+      h->max = value;
+}
+
+static uint64_t hist_percentile(const struct histogram *h, double percentile)
+{
+   uint64_t wanted = (uint64_t)ceil(h->count * percentile / 100.0);
+   uint64_t seen = 0;
+   for (int i = 0; i < HIST_BUCKETS; i++)
+   {
+      seen += h->buckets[i];
+      if (seen >= wanted && seen > 0)
+         return hist_bucket_value(i) < h->max ? hist_bucket_value(i) : h->max;
+   }
+   return h->max;
+}
+
+static void drain_samples(struct sample_ring *ring, struct histogram *histograms)
+{
+   unsigned head = ring->head;
+   unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+   for (; head != tail; head++)
+   {
+      struct sample *sample = &ring->samples[head % SAMPLE_RING_SIZE];
+      hist_record(&histograms[sample->metric], sample->ns);
+   }
+   __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+}
+
+static void watch_add(struct watch *w, uint32_t events)
+{
+   struct epoll_event ev = { 0 };
+   ev.events = events;
+   ev.data.ptr = w;
+   if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, w->fd, &ev) != 0)
+      perror("epoll_ctl");
+}
+
+static void watch_remove(struct watch *w)
+{
+   epoll_ctl(epoll_fd, EPOLL_CTL_DEL, w->fd, NULL);
+}
+
+static void ff_watch_handler(struct watch *w, uint32_t events);
+
+// ports are numbered across all adapters by slot, so the second adapter's
+// first port is "Port 5" wherever it's plugged in
+static void port_device_name(const struct ports *port, char *name, size_t size)
+{
+   int number = port->adapter->slot * 4 + port->index + 1;
+   const char *format = port->map->caps.name;
+   const char *mark = strstr(format, "%d");
+   if (format[0] == '\0')
+      snprintf(name, size, "Wii U GameCube Adapter Port %d", number);
+   else if (mark == NULL)
+      snprintf(name, size, "%s", format);
+   else
+      snprintf(name, size, "%.*s%d%s", (int)(mark - format), format, number, mark + 2);
+}
+
+// which adapter and port the device belongs to, for udev rules
+static void port_device_phys(const struct ports *port, char *phys, size_t size)
+{
+   snprintf(phys, size, "wii-u-gc-adapter/%s/port%d", port->adapter->name, port->index + 1);
+}
+
+// the range a report axis of port number n is advertised with
+static void axis_range(int n, const struct port_map *map, int j, int *min, int *max)
+{
+   bool raw = map->caps.raw && !calibrations[n].axes[j].set;
+   *min = raw ? 0 : port_luts[n].absmin[j];
+   *max = raw ? 255 : port_luts[n].absmax[j];
+}
+
+// describe the device with UI_DEV_SETUP and UI_ABS_SETUP, falling back to
+// writing a uinput_user_dev on kernels before 4.5
+static bool uinput_setup(struct ports *port)
+{
+   const struct port_map *map = port->map;
+   struct uinput_setup setup;
+   memset(&setup, 0, sizeof(setup));
+   port_device_name(port, setup.name, sizeof(setup.name));
+   setup.id.bustype = BUS_USB;
+   setup.id.vendor = map->caps.vendor;
+   setup.id.product = map->caps.product;
+   setup.ff_effects_max = ff_effects_max;
+
+   // the report axes take their range from the calibration, the ones
+   // driven by buttons from their values
+   struct input_absinfo absinfo[6 + MAX_BUTTON_AXES];
+   int codes[6 + MAX_BUTTON_AXES];
+   int count = 0;
+   memset(absinfo, 0, sizeof(absinfo));
+   for (int j = 0; j < 6; j++)
+   {
+      if (map->axis_code[j] < 0)
+         continue;
+      codes[count] = map->axis_code[j];
+      axis_range(port->number, map, j, &absinfo[count].minimum, &absinfo[count].maximum);
+      absinfo[count].fuzz = port_luts[port->number].absfuzz[j];
+      absinfo[count].flat = port_luts[port->number].absflat[j];
+      count++;
+   }
+   for (int k = 0; k < map->button_axis_count; k++)
+   {
+      codes[count] = map->button_axes[k].code;
+      absinfo[count].minimum = map->caps.absrange[k][0];
+      absinfo[count].maximum = map->caps.absrange[k][1];
+      count++;
+   }
+
+   if (ioctl(port->uinput, UI_DEV_SETUP, &setup) == 0)
+   {
+      // also sets the axis bits
+      for (int j = 0; j < count; j++)
+      {
+         struct uinput_abs_setup abs;
+         memset(&abs, 0, sizeof(abs));
+         abs.code = codes[j];
+         abs.absinfo = absinfo[j];
+         if (ioctl(port->uinput, UI_ABS_SETUP, &abs) != 0)
+         {
+            perror("error setting up uinput axis");
+            return false;
+         }
+      }
+      return true;
+   }
+
+   struct uinput_user_dev uinput_dev;
+   memset(&uinput_dev, 0, sizeof(uinput_dev));
+   for (int j = 0; j < count; j++)
+   {
+      int code = codes[j];
+      ioctl(port->uinput, UI_SET_ABSBIT, code);
+      uinput_dev.absmin[code] = absinfo[j].minimum;
+      uinput_dev.absmax[code] = absinfo[j].maximum;
+      uinput_dev.absfuzz[code] = absinfo[j].fuzz;
+      uinput_dev.absflat[code] = absinfo[j].flat;
+   }
+   memcpy(uinput_dev.name, setup.name, sizeof(uinput_dev.name));
+   uinput_dev.id = setup.id;
+   uinput_dev.ff_effects_max = ff_effects_max;
+
+   size_t to_write = sizeof(uinput_dev);
+   size_t written = 0;
+   while (written < to_write)
+   {
+      ssize_t write_ret = write(port->uinput, (const char*)&uinput_dev + written, to_write - written);
+      if (write_ret < 0)
+      {
+         perror("error writing uinput device settings");
+         return false;
+      }
+      written += write_ret;
+   }
+   return true;
+}
+
+static bool uinput_create(struct ports *port)
+{
+   port->uinput = open(uinput_path, O_RDWR | O_NONBLOCK);
+   const struct device_caps *caps = &port->map->caps;
+
+   // buttons
+   ioctl(port->uinput, UI_SET_EVBIT, EV_KEY);
+   for (int code = 0; code < KEY_CNT; code++)
+   {
+      if (caps->keybits[code / 8] & (1 << (code % 8)))
+         ioctl(port->uinput, UI_SET_KEYBIT, code);
+   }
+
+   // axis, set up by uinput_setup()
+   if (caps->absbits != 0)
+      ioctl(port->uinput, UI_SET_EVBIT, EV_ABS);
+
+   char phys[64];
+   port_device_phys(port, phys, sizeof(phys));
+   ioctl(port->uinput, UI_SET_PHYS, phys);
+
+   // rumble
+   ioctl(port->uinput, UI_SET_EVBIT, EV_FF);
+   ioctl(port->uinput, UI_SET_FFBIT, FF_PERIODIC);
+   ioctl(port->uinput, UI_SET_FFBIT, FF_SQUARE);
+   ioctl(port->uinput, UI_SET_FFBIT, FF_TRIANGLE);
+   ioctl(port->uinput, UI_SET_FFBIT, FF_SINE);
+   ioctl(port->uinput, UI_SET_FFBIT, FF_RUMBLE);
+   ioctl(port->uinput, UI_SET_FFBIT, FF_GAIN);
+
+   if (!uinput_setup(port))
+   {
+      close(port->uinput);
+      return false;
+   }
+
+   if (ioctl(port->uinput, UI_DEV_CREATE) != 0)
+   {
+      perror("error creating uinput device");
+      close(port->uinput);
+      return false;
+   }
+   return true;
+}
+
+// the gamepad a --output uhid port shows up as; the calibration decides the
+// axis ranges, the profile's mapping doesn't apply. Returns the size
+static int hid_descriptor(int n, const struct port_map *map, unsigned char *rd)
+{
+   static const unsigned char head[] = {
+      0x05, 0x01,             // usage page (generic desktop)
+      0x09, 0x05,             // usage (game pad)
+      0xa1, 0x01,             // collection (application)
+      0x85, HID_INPUT_REPORT, //   report id
+      0x05, 0x09,             //   usage page (button)
+      0x19, 0x01,             //   usage minimum (1)
+      0x29, 0x0c,             //   usage maximum (12)
+      0x15, 0x00,             //   logical minimum (0)
+      0x25, 0x01,             //   logical maximum (1)
+      0x75, 0x01,             //   report size (1)
+      0x95, 0x0c,             //   report count (12)
+      0x81, 0x02,             //   input (data, variable, absolute)
+      0x05, 0x01,             //   usage page (generic desktop)
+      0x09, 0x39,             //   usage (hat switch)
+      0x25, 0x07,             //   logical maximum (7)
+      0x35, 0x00,             //   physical minimum (0)
+      0x46, 0x3b, 0x01,       //   physical maximum (315)
+      0x65, 0x14,             //   unit (degrees)
+      0x75, 0x04,             //   report size (4)
+      0x95, 0x01,             //   report count (1)
+      0x81, 0x42,             //   input (data, variable, absolute, null state)
+      0x65, 0x00,             //   unit (none)
+      0x45, 0x00,             //   physical maximum (0)
+      0x75, 0x08,             //   report size (8)
+   };
+   static const unsigned char tail[] = {
+      0x85, HID_OUTPUT_REPORT, //  report id
+      0x06, 0x00, 0xff,       //   usage page (vendor defined)
+      0x09, 0x01,             //   usage (rumble level)
+      0x15, 0x00,             //   logical minimum (0)
+      0x26, 0xff, 0x00,       //   logical maximum (255)
+      0x91, 0x02,             //   output (data, variable, absolute)
+      0xc0,                   // end collection
+   };
+
+   int size = sizeof(head);
+   memcpy(rd, head, sizeof(head));
+   // one field per axis, each with its own range
+   for (int j = 0; j < 6; j++)
+   {
+      int min, max;
+      axis_range(n, map, j, &min, &max);
+      unsigned char axis[] = {
+         0x09, HID_AXIS_USAGES[j],
+         0x16, min & 0xff, min >> 8,
+         0x26, max & 0xff, max >> 8,
+         0x81, 0x02,
+      };
+      memcpy(rd + size, axis, sizeof(axis));
+      size += sizeof(axis);
+   }
+   memcpy(rd + size, tail, sizeof(tail));
+   return size + sizeof(tail);
+}
+
+// the port's current state as a HID input report
+static void hid_input_report(const struct ports *port, unsigned char *report)
+{
+   unsigned bits = 0;
+   for (uint32_t keys = port->buttons & 0x0f0f; keys != 0; keys &= keys - 1)
+      bits |= 1u << (HID_BUTTON_USAGES[__builtin_ctz(keys)] - 1);
+   report[0] = HID_INPUT_REPORT;
+   report[1] = bits & 0xff;
+   report[2] = (bits >> 8) | HID_HAT_VALUES[(port->buttons >> 12) & 0xf] << 4;
+   memcpy(&report[3], port->axis, sizeof(port->axis));
+}
+
+static bool uhid_create(struct ports *port)
+{
+   port->uinput = open(uhid_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+   if (port->uinput < 0)
+   {
+      perror(uhid_path);
+      return false;
+   }
+
+   struct uhid_event ev;
+   memset(&ev, 0, sizeof(ev));
+   ev.type = UHID_CREATE2;
+   struct uhid_create2_req *req = &ev.u.create2;
+   port_device_name(port, (char *)req->name, sizeof(req->name));
+   port_device_phys(port, (char *)req->phys, sizeof(req->phys));
+   req->rd_size = hid_descriptor(port->number, port->map, req->rd_data);
+   // not BUS_USB with the adapter's id, or SDL's HIDAPI driver for the
+   // adapter would grab the port and talk the adapter's protocol to it
+   req->bus = BUS_VIRTUAL;
+   req->vendor = port->map->caps.vendor;
+   req->product = port->map->caps.product;
+   if (write(port->uinput, &ev, sizeof(ev)) != sizeof(ev))
+   {
+      perror("error creating uhid device");
+      close(port->uinput);
+      return false;
+   }
+   return true;
+}
+
+// a virtual controller for the port, made the --output way
+static bool device_create(int i, struct ports *port, unsigned char type)
+{
+   fprintf(stderr, "connecting on port %d\n", i);
+   set_port_map(port, __atomic_load_n(&port_maps[port->number], __ATOMIC_ACQUIRE));
+   if (!(output_mode == OUTPUT_UHID ? uhid_create(port) : uinput_create(port)))
+      return false;
+
+   port->type = type;
+   port->connected = true;
+   port->detached = false;
+   port->ff_gain = 0xffff;
+   // a new device starts out with everything released and at zero
+   port->pending_count = 0;
+   port->buttons = 0;
+   port->report_buttons = 0;
+   memset(port->axis, 0, sizeof(port->axis));
+   memset(port->axis_dir, 0, sizeof(port->axis_dir));
+   port->held = false;
+
+   if (single_thread)
+   {
+      port->ff_watch.fd = port->uinput;
+      port->ff_watch.handler = ff_watch_handler;
+      port->ff_watch.data = port;
+      watch_add(&port->ff_watch, EPOLLIN);
+   }
+   return true;
+}
+
+static void device_destroy(int i, struct ports *port)
+{
+   fprintf(stderr, "disconnecting on port %d\n", i);
+   if (single_thread)
+      watch_remove(&port->ff_watch);
+   if (output_mode == OUTPUT_UHID)
+   {
+      uint32_t type = UHID_DESTROY;
+      if (write(port->uinput, &type, sizeof(type)) < 0)
+         perror("error destroying uhid device");
+   }
+   else
+   {
+      ioctl(port->uinput, UI_DEV_DESTROY);
+   }
+   close(port->uinput);
+   port->connected = false;
+   port->detached = false;
+}
+
+static struct timespec ns_to_timespec(int64_t ns)
+{
+   struct timespec ts = { ns / NSEC_PER_SEC, ns % NSEC_PER_SEC };
+   return ts;
+}
+
+static void capture_wake(void)
+{
+   uint64_t one = 1;
+   if (write(capture_wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      perror("eventfd write");
+}
+
+// hot path: copy one report or rumble packet into the adapter's ring,
+// returns false when it's full
+static bool capture_push(struct capture_ring *ring, int id, enum capture_kind kind, const unsigned char *data, int size, int64_t time)
+{
+   if (size > REPORT_SIZE)
+      size = REPORT_SIZE;
+
+   unsigned tail = ring->tail;
+   unsigned queued = tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+   if (queued >= CAPTURE_RING_SIZE)
+   {
+      __atomic_fetch_add(&capture_dropped, 1, __ATOMIC_RELAXED);
+      return false;
+   }
+   struct capture_record *r = &ring->records[tail % CAPTURE_RING_SIZE];
+   r->time = time;
+   r->adapter = id;
+   r->kind = kind;
+   r->size = size;
+   if (size > 0)
+      memcpy(r->data, data, size);
+   __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+   // the writer polls anyway, only wake it early when filling up
+   if (queued + 1 == CAPTURE_RING_SIZE / 2)
+      capture_wake();
+   return true;
+}
+
+// a free id and its rings for a new adapter, -1 when all are taken
+static int capture_claim_id(void)
+{
+   for (int id = 0; id < CAPTURE_IDS; id++)
+   {
+      if (__atomic_exchange_n(&capture_ids_used[id], true, __ATOMIC_ACQ_REL))
+         continue;
+      if (capture_streams[id] == NULL)
+      {
+         struct capture_stream *stream = calloc(1, sizeof(*stream));
+         if (stream == NULL)
+         {
+            fprintf(stderr, "FATAL: calloc() failed\n");
+            exit(-1);
+         }
+         __atomic_store_n(&capture_streams[id], stream, __ATOMIC_RELEASE);
+      }
+      return id;
+   }
+   fprintf(stderr, "Warning: out of capture ids, not recording new adapters\n");
+   return -1;
+}
+
+// the adapter's transport is closed, so this is the only producer left;
+// the writer closes the id's open run before anyone else gets the id
+static void capture_release_id(int id)
+{
+   struct capture_stream *stream = capture_streams[id];
+   while (!capture_push(&stream->reports, id, CAPTURE_CLOSE, NULL, 0, now_ns()))
+   {
+      capture_wake();
+      usleep(1000);
+   }
+   __atomic_store_n(&capture_ids_used[id], false, __ATOMIC_RELEASE);
+}
+
+static void capture_write(const struct capture_record *r)
+{
+   struct capture_record out;
+   memset(&out, 0, sizeof(out));
+   out.time = r->time;
+   out.span = r->span;
+   out.repeats = r->repeats;
+   out.adapter = r->adapter;
+   out.kind = r->kind;
+   out.size = r->size;
+   memcpy(out.data, r->data, r->size);
+   if (fwrite(&out, sizeof(out), 1, capture_file) != 1)
+      perror("capture write");
+}
+
+// the open run of identical reports per id, written out once a different
+// report arrives or the id is given back; only the writer touches these
+static struct capture_record capture_runs[CAPTURE_IDS];
+static bool capture_run_open[CAPTURE_IDS];
+
+static void capture_take(const struct capture_record *r)
+{
+   struct capture_record *run = &capture_runs[r->adapter];
+   if (r->kind == CAPTURE_RUMBLE)
+   {
+      capture_write(r);
+      return;
+   }
+   if (r->kind == CAPTURE_CLOSE)
+   {
+      if (capture_run_open[r->adapter])
+         capture_write(run);
+      capture_run_open[r->adapter] = false;
+      return;
+   }
+
+   int64_t span = r->time - run->time;
+   if (capture_run_open[r->adapter] && run->size == r->size && memcmp(run->data, r->data, r->size) == 0
+         && run->repeats < UINT16_MAX && span <= UINT32_MAX)
+   {
+      run->repeats++;
+      run->span = span;
+      return;
+   }
+   if (capture_run_open[r->adapter])
+      capture_write(run);
+   *run = *r;
+   run->repeats = 0;
+   run->span = 0;
+   capture_run_open[r->adapter] = true;
+}
+
+static void capture_drain(struct capture_ring *ring)
+{
+   unsigned head = ring->head;
+   unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+   for (; head != tail; head++)
+      capture_take(&ring->records[head % CAPTURE_RING_SIZE]);
+   __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+}
+
+static void *capture_writer(void *data)
+{
+   (void)data;
+   // disk writes shouldn't compete with the real-time I/O threads, which
+   // never wait for this thread
+   if (rt_priority > 0)
+   {
+      struct sched_param param = { .sched_priority = 0 };
+      pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+   }
+   unsigned reported_drops = 0;
+   bool stopping = false;
+
+   while (!stopping)
+   {
+      struct pollfd pfd = { capture_wake_fd, POLLIN, 0 };
+      if (poll(&pfd, 1, STATS_DRAIN_MSEC) > 0)
+      {
+         uint64_t wakeups;
+         if (read(capture_wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN)
+            perror("eventfd read");
+      }
+      // everything pushed before the stop is drained below
+      stopping = __atomic_load_n(&capture_stopping, __ATOMIC_ACQUIRE);
+
+      for (int id = 0; id < CAPTURE_IDS; id++)
+      {
+         struct capture_stream *stream = __atomic_load_n(&capture_streams[id], __ATOMIC_ACQUIRE);
+         if (stream == NULL)
+            continue;
+         capture_drain(&stream->rumble);
+         capture_drain(&stream->reports);
+      }
+
+      unsigned dropped = __atomic_load_n(&capture_dropped, __ATOMIC_RELAXED);
+      if (dropped != reported_drops)
+      {
+         fprintf(stderr, "capture ring overrun, %u records dropped\n", dropped - reported_drops);
+         reported_drops = dropped;
+      }
+      fflush(capture_file);
+   }
+
+   for (int i = 0; i < CAPTURE_IDS; i++)
+   {
+      if (capture_run_open[i])
+         capture_write(&capture_runs[i]);
+   }
+   return NULL;
+}
+
+static bool capture_init(const char *path)
+{
+   capture_file = fopen(path, "wb");
+   if (capture_file == NULL)
+   {
+      perror(path);
+      return false;
+   }
+
+   struct capture_header header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+   header.version = CAPTURE_VERSION;
+   header.record_size = sizeof(struct capture_record);
+   if (fwrite(&header, sizeof(header), 1, capture_file) != 1)
+   {
+      perror(path);
+      fclose(capture_file);
+      capture_file = NULL;
+      return false;
+   }
+
+   capture_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (capture_wake_fd < 0)
+   {
+      perror("FATAL: eventfd() failed");
+      exit(-1);
+   }
+   start_thread(&capture_thread, capture_writer, NULL);
+   fprintf(stderr, "recording to %s\n", path);
+   return true;
+}
+
+static void capture_exit(void)
+{
+   __atomic_store_n(&capture_stopping, true, __ATOMIC_RELEASE);
+   capture_wake();
+   pthread_join(capture_thread, NULL);
+   fclose(capture_file);
+   capture_file = NULL;
+   close(capture_wake_fd);
+   capture_wake_fd = -1;
+   for (int id = 0; id < CAPTURE_IDS; id++)
+   {
+      free(capture_streams[id]);
+      capture_streams[id] = NULL;
+   }
+}
+
+static void ff_heap_set(struct adapter *a, int i, struct ff_event *e)
+{
+   a->ff_heap[i] = e;
+   e->heap_index = i;
+}
+
+static void ff_heap_sift_up(struct adapter *a, int i)
+{
+   struct ff_event *e = a->ff_heap[i];
+   while (i > 0)
+   {
+      int parent = (i - 1) / 2;
+      if (a->ff_heap[parent]->deadline <= e->deadline)
+         break;
+      ff_heap_set(a, i, a->ff_heap[parent]);
+      i = parent;
+   }
+   ff_heap_set(a, i, e);
+}
+
+static void ff_heap_sift_down(struct adapter *a, int i)
+{
+   struct ff_event *e = a->ff_heap[i];
+   while (true)
+   {
+      int child = 2 * i + 1;
+      if (child >= a->ff_heap_size)
+         break;
+      if (child + 1 < a->ff_heap_size && a->ff_heap[child + 1]->deadline < a->ff_heap[child]->deadline)
+         child++;
+      if (e->deadline <= a->ff_heap[child]->deadline)
+         break;
+      ff_heap_set(a, i, a->ff_heap[child]);
+      i = child;
+   }
+   ff_heap_set(a, i, e);
+}
+
+static void ff_unschedule(struct adapter *a, struct ff_event *e)
+{
+   int i = e->heap_index;
+   if (i < 0)
+      return;
+
+   e->heap_index = -1;
+   struct ff_event *last = a->ff_heap[--a->ff_heap_size];
+   if (last == e)
+      return;
+
+   ff_heap_set(a, i, last);
+   ff_heap_sift_up(a, i);
+   ff_heap_sift_down(a, last->heap_index);
+}
+
+static void ff_schedule(struct adapter *a, struct ff_event *e, int64_t deadline)
+{
+   ff_unschedule(a, e);
+   e->deadline = deadline;
+   ff_heap_set(a, a->ff_heap_size++, e);
+   ff_heap_sift_up(a, e->heap_index);
+}
+
+static int64_t ff_next_deadline(struct adapter *a)
+{
+   int64_t deadline = a->ff_heap_size > 0 ? a->ff_heap[0]->deadline : INT64_MAX;
+   deadline = deadline < a->level_next ? deadline : a->level_next;
+   return deadline < a->pwm_next ? deadline : a->pwm_next;
+}
+
+static void ff_stop(struct adapter *a, struct ff_event *e)
+{
+   ff_unschedule(a, e);
+   if (e->state == FF_PLAYING)
+   {
+      e->port->ff_playing--;
+      a->ff_changed = true;
+   }
+   e->state = FF_IDLE;
+}
+
+static void ff_play(struct adapter *a, struct ff_event *e, int repetitions, int64_t now)
+{
+   ff_stop(a, e);
+   if (repetitions <= 0)
+      return;
+
+   e->repetitions = repetitions;
+   e->state = FF_WAITING;
+   e->start_time = now + e->delay * NSEC_PER_MSEC;
+   ff_schedule(a, e, e->start_time);
+}
+
+// advance every effect whose deadline has passed, repeats are timed from the
+// previous stop deadline rather than from when we got around to it
+static void ff_run(struct adapter *a, int64_t now)
+{
+   while (a->ff_heap_size > 0 && a->ff_heap[0]->deadline <= now)
+   {
+      struct ff_event *e = a->ff_heap[0];
+      ff_unschedule(a, e);
+
+      a->ff_changed = true;
+      if (e->state == FF_WAITING)
+      {
+         e->state = FF_PLAYING;
+         e->port->ff_playing++;
+         if (!e->forever)
+         {
+            e->end_time = e->start_time + e->duration * NSEC_PER_MSEC;
+            ff_schedule(a, e, e->end_time);
+         }
+      }
+      else
+      {
+         e->state = FF_IDLE;
+         e->port->ff_playing--;
+         if (--e->repetitions > 0)
+         {
+            e->state = FF_WAITING;
+            e->start_time = e->end_time + e->delay * NSEC_PER_MSEC;
+            ff_schedule(a, e, e->start_time);
+         }
+      }
+   }
+}
+
+static void ff_reset(struct ports *port)
+{
+   port->hid_rumble = 0;
+   for (int i = 0; i < ff_effects_max; i++)
+   {
+      ff_stop(port->adapter, &port->ff_events[i]);
+      port->ff_events[i].in_use = false;
+   }
+}
+
+static void set_ff_event(struct ff_event *e, struct uinput_ff_upload *upload, bool stop)
+{
+   e->effect = upload->effect;
+   if (stop)
+   {
+      e->forever = false;
+      e->duration = 0;
+   }
+   else
+   {
+      // events with length 0 last forever
+      e->forever = (upload->effect.replay.length == 0);
+      e->duration = upload->effect.replay.length;
+   }
+   e->delay = upload->effect.replay.delay;
+}
+
+static int32_t ff_envelope(const struct ff_envelope *env, int32_t magnitude, int64_t elapsed, int64_t remaining)
+{
+   // envelope levels are 0 - 0x7fff
+   if (env->attack_length > 0 && elapsed < env->attack_length)
+   {
+      int32_t start = env->attack_level * 2;
+      return start + (magnitude - start) * elapsed / env->attack_length;
+   }
+   if (env->fade_length > 0 && remaining >= 0 && remaining < env->fade_length)
+   {
+      int32_t end = env->fade_level * 2;
+      return end + (magnitude - end) * remaining / env->fade_length;
+   }
+   return magnitude;
+}
+
+// drive level of a playing effect at time now, 0 - FF_LEVEL_MAX; with peak
+// the strongest the waveform gets instead, for a motor that can't follow it
+static int32_t ff_effect_level(struct ff_event *e, int64_t now, bool peak)
+{
+   int64_t elapsed = (now - e->start_time) / NSEC_PER_MSEC;
+   int64_t remaining = e->forever ? -1 : (e->end_time - now) / NSEC_PER_MSEC;
+   int32_t level;
+
+   switch (e->effect.type)
+   {
+      case FF_RUMBLE:
+      {
+         // a single motor stands in for both, the weak one counts for half
+         level = e->effect.u.rumble.strong_magnitude + e->effect.u.rumble.weak_magnitude / 2;
+         break;
+      }
+      case FF_PERIODIC:
+      {
+         const struct ff_periodic_effect *periodic = &e->effect.u.periodic;
+         int32_t magnitude = ff_envelope(&periodic->envelope, abs(periodic->magnitude) * 2, elapsed, remaining);
+         double wave = 1.0;
+         if (peak)
+         {
+            level = abs(periodic->offset * 2) + magnitude;
+            break;
+         }
+         if (periodic->period > 0)
+         {
+            double phase = (double)(elapsed % periodic->period) / periodic->period + periodic->phase / 65536.0;
+            phase -= floor(phase);
+            switch (periodic->waveform)
+            {
+               case FF_SINE:
+                  wave = sin(2.0 * M_PI * phase);
+                  break;
+               case FF_SQUARE:
+                  wave = phase < 0.5 ? 1.0 : -1.0;
+                  break;
+               case FF_TRIANGLE:
+                  wave = 4.0 * fabs(phase - 0.5) - 1.0;
+                  break;
+            }
+         }
+         // the motor only knows how hard to spin, not which way
+         level = (int32_t)fabs(periodic->offset * 2 + magnitude * wave);
+         break;
+      }
+      default:
+         level = FF_LEVEL_MAX;
+         break;
+   }
+
+   return level > FF_LEVEL_MAX ? FF_LEVEL_MAX : level;
+}
+
+static int32_t ff_port_level(struct ports *port, int64_t now)
+{
+   int32_t level = 0;
+   for (int i = 0; i < ff_effects_max && level < FF_LEVEL_MAX; i++)
+   {
+      if (port->ff_events[i].state == FF_PLAYING)
+         level += ff_effect_level(&port->ff_events[i], now, false);
+   }
+   if (level > FF_LEVEL_MAX)
+      level = FF_LEVEL_MAX;
+   return (int64_t)level * port->ff_gain / 0xffff;
+}
+
+// when the peak level of a playing effect next goes to or from zero by
+// itself, INT64_MAX if it doesn't: only a periodic effect without offset
+// whose envelope attacks from or fades to level 0 ever gets there
+static int64_t ff_envelope_next(const struct ff_event *e, int64_t now)
+{
+   const struct ff_periodic_effect *periodic = &e->effect.u.periodic;
+   int64_t magnitude = abs(periodic->magnitude) * 2;
+   if (e->effect.type != FF_PERIODIC || periodic->offset != 0 || magnitude == 0)
+      return INT64_MAX;
+
+   const struct ff_envelope *env = &periodic->envelope;
+   bool fade = !e->forever && env->fade_length > 0 && env->fade_level == 0;
+   int64_t times[3] = { INT64_MAX, INT64_MAX, INT64_MAX };
+   if (env->attack_length > 0 && env->attack_level == 0)
+   {
+      // ff_envelope() gives magnitude * elapsed / attack_length in the
+      // attack, which is 0 until this many whole milliseconds
+      times[0] = e->start_time + (env->attack_length + magnitude - 1) / magnitude * NSEC_PER_MSEC;
+   }
+   if (fade && env->attack_length > 0)
+   {
+      // a short effect can end its attack already in the fade
+      times[1] = e->start_time + env->attack_length * NSEC_PER_MSEC;
+   }
+   if (fade)
+   {
+      // and magnitude * remaining / fade_length in the fade
+      times[2] = e->end_time - (env->fade_length + magnitude - 1) / magnitude * NSEC_PER_MSEC + 1;
+   }
+
+   int64_t next = INT64_MAX;
+   for (int k = 0; k < 3; k++)
+   {
+      if (times[k] > now && times[k] < next)
+         next = times[k];
+   }
+   return next;
+}
+
+// whether any playing effect of the port drives the motor at all, and the
+// soonest an envelope can change that into next
+static bool ff_port_active(struct ports *port, int64_t now, int64_t *next)
+{
+   bool active = false;
+   for (int i = 0; i < ff_effects_max; i++)
+   {
+      struct ff_event *e = &port->ff_events[i];
+      if (e->state != FF_PLAYING)
+         continue;
+      active |= ff_effect_level(e, now, true) > 0;
+      int64_t change = ff_envelope_next(e, now);
+      if (change < *next)
+         *next = change;
+   }
+   return active;
+}
+
+static int create_ff_event(struct ports *port, struct uinput_ff_upload *upload)
+{
+   bool stop = false;
+   switch (upload->effect.type)
+   {
+      case FF_PERIODIC:
+         stop = upload->effect.u.periodic.magnitude == 0;
+         break;
+      case FF_RUMBLE:
+         stop = upload->effect.u.rumble.strong_magnitude == 0 && upload->effect.u.rumble.weak_magnitude == 0;
+         break;
+   }
+   if (upload->old.type != 0)
+   {
+      if (upload->old.id < 0 || upload->old.id >= ff_effects_max)
+         return -1;
+
+      // an updated effect finishes its current play with the new length
+      struct ff_event *e = &port->ff_events[upload->old.id];
+      set_ff_event(e, upload, stop);
+      port->adapter->ff_changed = true;
+      if (e->state != FF_IDLE)
+         e->repetitions = 1;
+      if (e->state == FF_PLAYING)
+      {
+         if (e->forever)
+         {
+            ff_unschedule(port->adapter, e);
+         }
+         else
+         {
+            e->end_time = e->start_time + e->duration * NSEC_PER_MSEC;
+            ff_schedule(port->adapter, e, e->end_time);
+         }
+      }
+      return upload->old.id;
+   }
+   for (int i = 0; i < ff_effects_max; i++)
+   {
+      if (!port->ff_events[i].in_use)
+      {
+         port->ff_events[i].in_use = true;
+         set_ff_event(&port->ff_events[i], upload, stop);
+         port->ff_events[i].repetitions = 0;
+         return i;
+      }
+   }
+
+   return -1;
+}
+
+static void erase_ff_event(struct ports *port, unsigned id)
+{
+   if (id >= (unsigned)ff_effects_max)
+      return;
+   ff_stop(port->adapter, &port->ff_events[id]);
+   port->ff_events[id].in_use = false;
+}
+
+// uinput stamps its requests with CLOCK_MONOTONIC
+static void track_upload_wait(int i, struct ports *port, struct input_event *e)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   long waited = (now.tv_sec - e->input_event_sec) * 1000000L + (now.tv_nsec / 1000 - e->input_event_usec);
+   if (waited > port->ff_upload_wait_max)
+      __atomic_store_n(&port->ff_upload_wait_max, waited, __ATOMIC_RELAXED);
+   sample_push(&port->adapter->proc_samples, METRIC_FF_UPLOAD, waited * 1000);
+   if (verbose)
+      fprintf(stderr, "port %d: effect upload waited %ld us (max %ld us)\n", port->adapter->slot * 4 + i + 1,
+            waited, port->ff_upload_wait_max);
+}
+
+static void handle_ff_event(int i, struct ports *port, struct input_event *e, int64_t current_time)
+{
+   // a request landing right on a deadline, or right behind a play in the
+   // same batch, sees the effects as they are by now
+   ff_run(port->adapter, current_time);
+   if (e->type == EV_UINPUT)
+   {
+      switch (e->code)
+      {
+         case UI_FF_UPLOAD:
+         {
+            track_upload_wait(i, port, e);
+            struct uinput_ff_upload upload = { 0 };
+            upload.request_id = e->value;
+            ioctl(port->uinput, UI_BEGIN_FF_UPLOAD, &upload);
+            int id = create_ff_event(port, &upload);
+            if (id < 0)
+            {
+               // TODO: what's the proper error code for this?
+               upload.retval = -1;
+            }
+            else
+            {
+               upload.retval = 0;
+               upload.effect.id = id;
+            }
+            ioctl(port->uinput, UI_END_FF_UPLOAD, &upload);
+            break;
+         }
+         case UI_FF_ERASE:
+         {
+            struct uinput_ff_erase erase = { 0 };
+            erase.request_id = e->value;
+            ioctl(port->uinput, UI_BEGIN_FF_ERASE, &erase);
+            erase_ff_event(port, erase.effect_id);
+            ioctl(port->uinput, UI_END_FF_ERASE, &erase);
+         }
+      }
+   }
+   else if (e->type == EV_FF && e->code == FF_GAIN)
+   {
+      port->ff_gain = e->value > 0xffff ? 0xffff : e->value;
+      port->adapter->ff_changed = true;
+   }
+   else if (e->type == EV_FF)
+   {
+      if (e->code < ff_effects_max && port->ff_events[e->code].in_use)
+         ff_play(port->adapter, &port->ff_events[e->code], e->value, current_time);
+   }
+}
+
+static void set_hid_rumble(struct ports *port, int level)
+{
+   if (level == port->hid_rumble)
+      return;
+   port->hid_rumble = level;
+   port->adapter->ff_changed = true;
+}
+
+// uhid hands out one event per read; output reports set the rumble level
+// and report requests are answered right away since the kernel waits for
+// them
+static void service_uhid(struct ports *port)
+{
+   struct uhid_event ev;
+   while (read(port->uinput, &ev, sizeof(ev)) > 0)
+   {
+      add_syscalls(port->adapter, 1);
+      if (ev.type == UHID_OUTPUT)
+      {
+         struct uhid_output_req *req = &ev.u.output;
+         if (req->rtype == UHID_OUTPUT_REPORT && req->size >= 2 && req->data[0] == HID_OUTPUT_REPORT)
+            set_hid_rumble(port, req->data[1]);
+      }
+      else if (ev.type == UHID_SET_REPORT)
+      {
+         struct uhid_set_report_req req = ev.u.set_report;
+         bool rumble = req.rtype == UHID_OUTPUT_REPORT && req.rnum == HID_OUTPUT_REPORT && req.size >= 2;
+         if (rumble)
+            set_hid_rumble(port, req.data[1]);
+         memset(&ev, 0, sizeof(ev));
+         ev.type = UHID_SET_REPORT_REPLY;
+         ev.u.set_report_reply.id = req.id;
+         ev.u.set_report_reply.err = rumble ? 0 : EIO;
+         if (write(port->uinput, &ev, sizeof(ev)) < 0)
+            perror("uhid write");
+      }
+      else if (ev.type == UHID_GET_REPORT)
+      {
+         struct uhid_get_report_req req = ev.u.get_report;
+         memset(&ev, 0, sizeof(ev));
+         ev.type = UHID_GET_REPORT_REPLY;
+         ev.u.get_report_reply.id = req.id;
+         if (req.rtype == UHID_INPUT_REPORT && req.rnum == HID_INPUT_REPORT)
+         {
+            ev.u.get_report_reply.size = HID_INPUT_SIZE;
+            hid_input_report(port, ev.u.get_report_reply.data);
+         }
+         else
+         {
+            ev.u.get_report_reply.err = EIO;
+         }
+         if (write(port->uinput, &ev, sizeof(ev)) < 0)
+            perror("uhid write");
+      }
+   }
+   add_syscalls(port->adapter, 1);
+}
+
+// handle every queued force feedback request, uinput hands out as many whole
+// events as fit in the buffer so a burst is drained in a few reads
+static void service_ff(int i, struct ports *port, int64_t current_time)
+{
+   if (output_mode == OUTPUT_UHID)
+   {
+      service_uhid(port);
+      return;
+   }
+
+   struct input_event events[FF_READ_BATCH];
+   while (true)
+   {
+      ssize_t ret = read(port->uinput, events, sizeof(events));
+      add_syscalls(port->adapter, 1);
+      if (ret <= 0)
+         break;
+
+      int count = ret / sizeof(events[0]);
+      for (int j = 0; j < count; j++)
+         handle_ff_event(i, port, &events[j], current_time);
+
+      if (count < FF_READ_BATCH)
+         break;
+   }
+}
+
+static bool init_decoder(void)
+{
+   for (int j = 0; j < 16; j++)
+   {
+      if (BUTTON_OFFSET_VALUES[j] != -1)
+         button_mask |= 1 << j;
+   }
+   compile_calibrations();
+   return install_profile();
+}
+
+#if defined(__ARM_NEON)
+static unsigned neon_movemask(uint8x16_t v)
+{
+   static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+   uint8x16_t bits = vandq_u8(v, vld1q_u8(weights));
+   uint8x8_t lo = vget_low_u8(bits);
+   uint8x8_t hi = vget_high_u8(bits);
+   lo = vpadd_u8(lo, lo);
+   lo = vpadd_u8(lo, lo);
+   lo = vpadd_u8(lo, lo);
+   hi = vpadd_u8(hi, hi);
+   hi = vpadd_u8(hi, hi);
+   hi = vpadd_u8(hi, hi);
+   return vget_lane_u8(lo, 0) | (unsigned)vget_lane_u8(hi, 0) << 8;
+}
+#endif
+
+// also what the bench checks the vector versions against
+static unsigned report_diff_scalar(const unsigned char *prev, const unsigned char *cur)
+{
+   unsigned changed = 0;
+   for (int i = 0; i < 4; i++)
+   {
+      const unsigned char *p = &prev[1 + i * 9];
+      const unsigned char *c = &cur[1 + i * 9];
+      uint64_t p8, c8;
+      memcpy(&p8, p, sizeof(p8));
+      memcpy(&c8, c, sizeof(c8));
+      if ((p8 ^ c8) | (p[8] ^ c[8]))
+         changed |= 1 << i;
+   }
+   return changed;
+}
+
+// bit i is set when any of the 9 bytes of port i differ between the reports
+static unsigned report_diff(const unsigned char *prev, const unsigned char *cur)
+{
+#if defined(__SSE2__) || defined(__ARM_NEON)
+   // the 36 port bytes start at offset 1; the last load overlaps the middle
+   // one so nothing is read past the end of the report
+   uint64_t diff;
+#if defined(__SSE2__)
+   unsigned m0 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&prev[1]), _mm_loadu_si128((const __m128i *)&cur[1])));
+   unsigned m1 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&prev[17]), _mm_loadu_si128((const __m128i *)&cur[17])));
+   unsigned m2 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&prev[21]), _mm_loadu_si128((const __m128i *)&cur[21])));
+#else
+   unsigned m0 = neon_movemask(vceqq_u8(vld1q_u8(&prev[1]), vld1q_u8(&cur[1])));
+   unsigned m1 = neon_movemask(vceqq_u8(vld1q_u8(&prev[17]), vld1q_u8(&cur[17])));
+   unsigned m2 = neon_movemask(vceqq_u8(vld1q_u8(&prev[21]), vld1q_u8(&cur[21])));
+#endif
+   diff = (uint64_t)(~m0 & 0xFFFF) | (uint64_t)(~m1 & 0xFFFF) << 16 | (uint64_t)(~m2 & 0xFFFF) << 20;
+
+   unsigned changed = 0;
+   for (int i = 0; i < 4; i++)
+      changed |= ((diff >> (i * 9)) & 0x1FF) != 0 ? 1 << i : 0;
+   return changed;
+#else
+   return report_diff_scalar(prev, cur);
+#endif
+}
+
+// the counters have a single writer at a time, so no locked increment is
+// needed; dump_stats and the control socket read them with relaxed loads
+static void count_add(uint64_t *counter, uint64_t n)
+{
+   __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+// write the port's pending events in one go
+static void flush_port(struct ports *port)
+{
+   struct adapter *a = port->adapter;
+   size_t to_write = sizeof(port->pending[0]) * port->pending_count;
+   size_t written = 0;
+   unsigned syscalls = 0;
+   port->pending_count = 0;
+   while (written < to_write)
+   {
+      int64_t write_start = now_ns();
+      ssize_t write_ret = write(port->uinput, (const char*)port->pending + written, to_write - written);
+      int64_t write_end = now_ns();
+      syscalls++;
+      if (write_ret >= 0)
+      {
+         sample_push(&a->proc_samples, METRIC_WRITE, write_end - write_start);
+         written += write_ret;
+         continue;
+      }
+      if (errno == EINTR)
+         continue;
+      if (errno == EAGAIN)
+      {
+         // wait for room once instead of spinning on a full queue
+         struct pollfd pfd = { port->uinput, POLLOUT, 0 };
+         syscalls++;
+         if (poll(&pfd, 1, UINPUT_WRITE_TIMEOUT_MSEC) > 0)
+            continue;
+         errno = EAGAIN;
+      }
+      perror("Warning: writing input events failed");
+      count_add(&port->write_errors, 1);
+      break;
+   }
+   count_add(&port->events, written / sizeof(port->pending[0]));
+   add_syscalls(a, syscalls);
+}
+
+// hysteresis against a worn stick flickering between two values: a one
+// step move is only taken if it continues the axis' last move or lands on
+// the rest position or an end of the range. Returns whether any was dropped
+static bool filter_jitter(struct ports *port, unsigned char *values)
+{
+   bool filtered = false;
+   for (int j = 0; j < 6; j++)
+   {
+      int delta = values[j] - port->axis[j];
+      if (delta == 0)
+         continue;
+      int dir = delta > 0 ? 1 : -1;
+      // the ends of the range the device has, 0-255 for a raw axis
+      int min, max;
+      axis_range(port->number, port->map, j, &min, &max);
+      bool settled = (centered_axis(j) && values[j] == 128) || values[j] == min || values[j] == max;
+      if (delta * dir == 1 && dir != port->axis_dir[j] && !settled)
+      {
+         values[j] = port->axis[j];
+         filtered = true;
+         continue;
+      }
+      port->axis_dir[j] = dir;
+   }
+   return filtered;
+}
+
+// the calibrated axes of one port's part of a report, returns whether the
+// jitter filter dropped a move
+static bool read_axes(struct ports *port, const unsigned char *payload, unsigned char *values)
+{
+   const struct port_luts *luts = &port_luts[port->number];
+   for (int j = 0; j < 6; j++)
+      values[j] = luts->lut[j][payload[j+3]];
+
+   for (int s = 0; s < 2; s++)
+   {
+      int dx = values[s*2] - 128;
+      int dy = values[s*2+1] - 128;
+      if (dx * dx + dy * dy < luts->radial_sq[s])
+         values[s*2] = values[s*2+1] = 128;
+   }
+   // before the thresholds, so a noisy trigger doesn't flicker its button
+   return emit_mode == EMIT_JITTER && filter_jitter(port, values);
+}
+
+// the report's button bits, with analog L/R past the threshold also
+// pressing the digital buttons
+static uint32_t read_buttons(const struct ports *port, const unsigned char *payload, const unsigned char *values)
+{
+   const struct port_luts *luts = &port_luts[port->number];
+   uint32_t btns = ((uint32_t) payload[1] << 8 | (uint32_t) payload[2]) & button_mask;
+   return btns | (values[4] >= luts->threshold[0]) << 3 | (values[5] >= luts->threshold[1]) << 2;
+}
+
+// with --emit rate an axis-only change that comes too soon is held back
+// and sent later with whatever the axes are at by then
+static bool hold_axes(struct ports *port, uint32_t changed, const unsigned char *values, int64_t now)
+{
+   port->held = false;
+   if (emit_mode != EMIT_RATE || changed != 0 || now >= port->next_axis_frame
+         || memcmp(values, port->axis, sizeof(port->axis)) == 0)
+      return false;
+   port->held = true;
+   count_add(&port->frames_suppressed, 1);
+   return true;
+}
+
+// turn a port's buttons and calibrated axes into input events (at most
+// MAX_PAYLOAD_EVENTS), returns how many were built
+static int decode_state(struct ports *port, uint32_t btns, const unsigned char *values, bool filtered, struct input_event *events, int64_t now)
+{
+   int e_count = 0;
+
+   const struct port_map *map = port->map;
+   port->report_buttons = btns;
+   // and any axis past its profile threshold its own button
+   for (int t = 0; t < map->threshold_count; t++)
+   {
+      int j = map->threshold_axis[t];
+      btns |= (uint32_t)(values[j] >= map->axis_threshold[j]) << (BIT_AXIS_BUTTON + j);
+   }
+   for (int c = 0; c < map->combo_count; c++)
+   {
+      uint32_t mask = map->combo_mask[c];
+      if ((btns & mask) == mask)
+         btns = (btns & ~mask) | 1u << (BIT_COMBO + c);
+   }
+
+   uint32_t changed = btns ^ port->buttons;
+   if (hold_axes(port, changed, values, now))
+      return 0;
+
+   // only visit the buttons that actually changed, lowest bit first
+   for (uint32_t keys = changed & map->key_mask; keys != 0; keys &= keys - 1)
+   {
+      int j = __builtin_ctz(keys);
+      events[e_count].type = EV_KEY;
+      events[e_count].code = map->button_code[j];
+      events[e_count].value = (btns >> j) & 1;
+      e_count++;
+   }
+   port->buttons = btns;
+
+   for (int j = 0; j < 6; j++)
+   {
+      unsigned char value = values[j];
+      if (port->axis[j] != value)
+      {
+         port->axis[j] = value;
+         if (map->axis_code[j] < 0)
+            continue;
+         events[e_count].type = EV_ABS;
+         events[e_count].code = map->axis_code[j];
+         events[e_count].value = value;
+         e_count++;
+      }
+   }
+
+   for (int k = 0; k < map->button_axis_count; k++)
+   {
+      const struct button_axis *ba = &map->button_axes[k];
+      if ((changed & ba->mask) == 0)
+         continue;
+      int value = 0;
+      for (int t = 0; t < ba->term_count; t++)
+         value += ((btns >> ba->bit[t]) & 1) * ba->value[t];
+      events[e_count].type = EV_ABS;
+      events[e_count].code = ba->code;
+      events[e_count].value = value;
+      e_count++;
+   }
+
+   if (e_count > 0)
+   {
+      events[e_count].type = EV_SYN;
+      events[e_count].code = SYN_REPORT;
+      events[e_count].value = 0;
+      e_count++;
+      count_add(&port->frames, 1);
+      port->next_axis_frame = now + NSEC_PER_SEC / emit_rate_hz;
+   }
+   else if (filtered)
+   {
+      count_add(&port->frames_suppressed, 1);
+   }
+   return e_count;
+}
+
+// turn one port's part of a report into input events, returns how many
+// were built. Depending on the emission mode, axis changes may be held
+// back (port->held) or dropped
+static int decode_payload(struct ports *port, const unsigned char *payload, struct input_event *events, int64_t now)
+{
+   unsigned char values[6];
+   bool filtered = read_axes(port, payload, values);
+   uint32_t btns = read_buttons(port, payload, values);
+   return decode_state(port, btns, values, filtered, events, now);
+}
+
+// write the port's state as one HID input report
+static void uhid_send(struct ports *port)
+{
+   unsigned char buf[UHID_INPUT2_HEADER + HID_INPUT_SIZE];
+   uint32_t type = UHID_INPUT2;
+   uint16_t size = HID_INPUT_SIZE;
+   memcpy(buf, &type, sizeof(type));
+   memcpy(buf + offsetof(struct uhid_event, u.input2.size), &size, sizeof(size));
+   hid_input_report(port, buf + UHID_INPUT2_HEADER);
+
+   int64_t write_start = now_ns();
+   ssize_t ret = write(port->uinput, buf, sizeof(buf));
+   int64_t write_end = now_ns();
+   add_syscalls(port->adapter, 1);
+   if (ret < 0)
+   {
+      perror("Warning: writing HID report failed");
+      count_add(&port->write_errors, 1);
+      return;
+   }
+   sample_push(&port->adapter->proc_samples, METRIC_WRITE, write_end - write_start);
+   count_add(&port->events, 1);
+}
+
+// the uhid counterpart of decode_state(): the buttons and axes as they
+// are, the profile's mapping doesn't apply. Sends one report if anything
+// changed and returns whether it did
+static bool uhid_state(struct ports *port, uint32_t btns, const unsigned char *values, bool filtered, int64_t now)
+{
+   port->report_buttons = btns;
+   uint32_t changed = btns ^ port->buttons;
+   if (hold_axes(port, changed, values, now))
+      return false;
+
+   if (changed == 0 && memcmp(values, port->axis, sizeof(port->axis)) == 0)
+   {
+      if (filtered)
+         count_add(&port->frames_suppressed, 1);
+      return false;
+   }
+   port->buttons = btns;
+   memcpy(port->axis, values, sizeof(port->axis));
+   count_add(&port->frames, 1);
+   port->next_axis_frame = now + NSEC_PER_SEC / emit_rate_hz;
+   uhid_send(port);
+   return true;
+}
+
+static bool uhid_payload(struct ports *port, const unsigned char *payload, int64_t now)
+{
+   unsigned char values[6];
+   bool filtered = read_axes(port, payload, values);
+   uint32_t btns = read_buttons(port, payload, values);
+   return uhid_state(port, btns, values, filtered, now);
+}
+
+static void disconnect_port(int i, struct ports *port)
+{
+   flush_port(port);
+   device_destroy(i, port);
+   ff_reset(port);
+}
+
+// keep the device of a controller that went away, released and centered,
+// for a controller showing up on the port later
+static void detach_port(int i, struct ports *port, int64_t now)
+{
+   // straight in output space, a calibration needn't put raw 128 on center
+   const unsigned char *neutral = port_luts[port->number].rest;
+   if (PORT_EVENT_BUFFER - port->pending_count < MAX_PAYLOAD_EVENTS)
+      flush_port(port);
+   // never held back
+   port->next_axis_frame = now;
+   if (output_mode == OUTPUT_UHID)
+   {
+      uhid_state(port, 0, neutral, false, now);
+   }
+   else
+   {
+      port->pending_count += decode_state(port, 0, neutral, false, &port->pending[port->pending_count], now);
+      flush_port(port);
+   }
+   for (int j = 0; j < ff_effects_max; j++)
+      ff_stop(port->adapter, &port->ff_events[j]);
+
+   port->detached = true;
+   port->extra_power = false;
+   port->detach_deadline = precreate_ports ? INT64_MAX : now + port_grace_msec * NSEC_PER_MSEC;
+   if (verbose)
+      fprintf(stderr, "keeping the device on port %d\n", i);
+}
+
+// a reloaded profile. If the device can stay, everything held is let go
+// under the old mapping and the port decoded again with the new one;
+// otherwise the device is recreated. Returns whether the port needs decoding
+static bool leave_port_map(int i, struct ports *port, const struct port_map *old, const struct port_map *map)
+{
+   if (memcmp(&old->caps, &map->caps, sizeof(map->caps)) != 0)
+   {
+      disconnect_port(i, port);
+      return true;
+   }
+   // a HID device doesn't use the rest of the map
+   if (output_mode == OUTPUT_UHID)
+      return false;
+
+   if (PORT_EVENT_BUFFER - port->pending_count < MAX_PAYLOAD_EVENTS)
+      flush_port(port);
+   struct input_event *events = &port->pending[port->pending_count];
+   int e_count = 0;
+   for (uint32_t keys = port->buttons & old->key_mask; keys != 0; keys &= keys - 1)
+   {
+      events[e_count].type = EV_KEY;
+      events[e_count].code = old->button_code[__builtin_ctz(keys)];
+      events[e_count].value = 0;
+      e_count++;
+   }
+   for (int k = 0; k < old->button_axis_count; k++)
+   {
+      events[e_count].type = EV_ABS;
+      events[e_count].code = old->button_axes[k].code;
+      events[e_count].value = 0;
+      e_count++;
+   }
+   events[e_count].type = EV_SYN;
+   events[e_count].code = SYN_REPORT;
+   events[e_count].value = 0;
+   port->pending_count += e_count + 1;
+   port->buttons = 0;
+   memset(port->axis, 0, sizeof(port->axis));
+   return true;
+}
+
+static bool switch_port_map(int i, struct ports *port, const struct port_map *map)
+{
+   bool decode = port->connected && leave_port_map(i, port, port->map, map);
+   // the old map is read up to here, only now may its set go
+   set_port_map(port, map);
+   return decode;
+}
+
+static bool handle_payload(int i, struct ports *port, unsigned char *payload, int64_t now)
+{
+   unsigned char status = payload[0];
+   unsigned char type = connected_type(status);
+
+   if (type != 0 && !port->connected)
+   {
+      if (!device_create(i, port, type))
+         port->adapter->resync |= 1 << i;
+   }
+   else if (type != 0 && port->detached)
+   {
+      // same device, whichever controller it is now
+      port->detached = false;
+      port->type = type;
+      if (verbose)
+         fprintf(stderr, "reusing the device on port %d\n", i);
+   }
+   else if (type == 0 && port->connected && !port->detached)
+   {
+      if (port_grace_msec > 0 || precreate_ports)
+         detach_port(i, port, now);
+      else
+         disconnect_port(i, port);
+   }
+
+   if (!port->connected || port->detached)
+      return false;
+
+   port->extra_power = ((status & 0x04) != 0);
+
+   if (type != port->type)
+   {
+      fprintf(stderr, "controller on port %d changed controller type???\n", i+1);
+      port->type = type;
+   }
+
+   bool emitted;
+   if (output_mode == OUTPUT_UHID)
+   {
+      // a single HID report, written right away
+      emitted = uhid_payload(port, payload, now);
+   }
+   else
+   {
+      // buttons + axis + syn event; written by flush_port() once the batch
+      // of queued reports has been decoded
+      if (PORT_EVENT_BUFFER - port->pending_count < MAX_PAYLOAD_EVENTS)
+         flush_port(port);
+      int e_count = decode_payload(port, payload, &port->pending[port->pending_count], now);
+      port->pending_count += e_count;
+      emitted = e_count > 0;
+   }
+   // the port's bytes may not change again, so make sure it's looked at
+   if (port->held)
+      port->adapter->resync |= 1 << i;
+   return emitted;
+}
+
+static void ff_update(struct adapter *a, int64_t now);
+
+static void ff_watch_handler(struct watch *w, uint32_t events)
+{
+   (void)events;
+   struct ports *port = (struct ports *)w->data;
+   int64_t now = now_ns();
+   service_ff(port->index, port, now);
+   ff_update(port->adapter, now);
+}
+
+static void wake_io_thread(struct adapter *a)
+{
+   uint64_t one = 1;
+   if (write(a->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      perror("eventfd write");
+}
+
+static void stop_adapter(struct adapter *a)
+{
+   pthread_mutex_lock(&a->queue_lock);
+   a->quitting = true;
+   pthread_mutex_unlock(&a->queue_lock);
+   if (a->wake_fd >= 0)
+      wake_io_thread(a);
+}
+
+// call with rumble_lock held
+static void submit_rumble(struct adapter *a)
+{
+   memcpy(a->rumble_buffer, a->rumble_next, sizeof(a->rumble_buffer));
+   a->rumble_queued = false;
+   a->rumble_submit_time = now_ns();
+   if (a->capture != NULL)
+      capture_push(&a->capture->rumble, a->capture_id, CAPTURE_RUMBLE, a->rumble_buffer, sizeof(a->rumble_buffer), a->rumble_submit_time);
+
+   if (!a->transport->write_rumble(a))
+   {
+      // this may run on the I/O thread, so the main loop is woken to
+      // recover the adapter, which sends the state again once it's back;
+      // no more writes until then
+      a->rumble_queued = true;
+      a->rumble_paused = true;
+      __atomic_store_n(&a->rumble_failed, true, __ATOMIC_RELEASE);
+      uint64_t one = 1;
+      if (write(hotplug_watch.fd, &one, sizeof(one)) < 0)
+         perror("eventfd write");
+      return;
+   }
+   count_add(&a->rumble_packets, 1);
+   a->rumble_in_flight = true;
+}
+
+static void queue_rumble(struct adapter *a, const unsigned char *rumble)
+{
+   pthread_mutex_lock(&a->rumble_lock);
+   memcpy(a->rumble_next, rumble, sizeof(a->rumble_next));
+   if (a->rumble_in_flight || a->rumble_paused)
+      a->rumble_queued = true;
+   else if (!a->quitting)
+      submit_rumble(a);
+   pthread_mutex_unlock(&a->rumble_lock);
+}
+
+// called by the transport when a rumble write finished
+static void rumble_done(struct adapter *a, enum transfer_result result)
+{
+   pthread_mutex_lock(&a->rumble_lock);
+   a->rumble_in_flight = false;
+   if (result == TRANSFER_OK)
+   {
+      sample_push(&a->usb_samples, METRIC_RUMBLE_RTT, now_ns() - a->rumble_submit_time);
+      if (a->rumble_queued && !a->quitting && !a->rumble_paused)
+         submit_rumble(a);
+   }
+   else if (result == TRANSFER_FAILED)
+   {
+      // the transport recovers from the error, then the state is sent again
+      a->rumble_queued = true;
+   }
+   pthread_mutex_unlock(&a->rumble_lock);
+}
+
+// hold rumble writes while the adapter recovers; the adapter comes back
+// with its motors off, so the current state is sent again after
+static void pause_rumble(struct adapter *a)
+{
+   pthread_mutex_lock(&a->rumble_lock);
+   a->rumble_paused = true;
+   // rumble packets start with 0x11, nothing was ever sent without one
+   if (a->rumble_next[0] != 0)
+      a->rumble_queued = true;
+   pthread_mutex_unlock(&a->rumble_lock);
+}
+
+static void resume_rumble(struct adapter *a)
+{
+   pthread_mutex_lock(&a->rumble_lock);
+   a->rumble_paused = false;
+   if (a->rumble_queued && !a->rumble_in_flight && !a->quitting)
+      submit_rumble(a);
+   pthread_mutex_unlock(&a->rumble_lock);
+}
+
+// the motor is either on or off, so with --rumble-pwm the summed effect level
+// is turned into an on/off pattern by a first order sigma-delta modulator
+// stepped at the PWM rate; the packet still only goes out when it changes
+static void update_rumble(struct adapter *a, int64_t now)
+{
+   unsigned char rumble[5] = { 0x11, 0, 0, 0, 0 };
+   bool rumble_on = __atomic_load_n(&rumble_enabled, __ATOMIC_RELAXED);
+   bool first_step = a->pwm_next == INT64_MAX;
+   bool step = now >= a->pwm_next || first_step;
+   bool modulating = false;
+   // on/off levels only change with a request, a play starting or ending
+   // or an envelope reaching or leaving zero
+   bool relevel = a->ff_changed || now >= a->level_next;
+   if (relevel)
+      a->level_next = INT64_MAX;
+
+   for (int i = 0; i < 4; i++)
+   {
+      struct ports *port = &a->controllers[i];
+      bool playing = port->ff_playing > 0 || port->hid_rumble > 0;
+      if (!port->extra_power || port->type != STATE_NORMAL || !playing || !rumble_on)
+      {
+         // stale by the time the port rumbles again
+         port->ff_level = -1;
+         port->pwm_acc = 0;
+         port->pwm_on = false;
+         continue;
+      }
+
+      if (rumble_pwm_hz == 0)
+      {
+         // full on whatever the strength, but off while the gain or an
+         // envelope has it at nothing
+         if (relevel || port->ff_level < 0)
+         {
+            bool active = port->hid_rumble > 0 || (port->ff_gain > 0 && ff_port_active(port, now, &a->level_next));
+            port->ff_level = active ? FF_LEVEL_MAX : 0;
+         }
+         rumble[i+1] = port->ff_level > 0;
+         continue;
+      }
+
+      // waveforms and envelopes change over time, keep stepping while
+      // anything plays
+      modulating = true;
+      if (step || a->ff_changed)
+      {
+         port->ff_level = port->hid_rumble > 0 ? port->hid_rumble * FF_LEVEL_MAX / 255
+            : ff_port_level(port, now);
+      }
+      if (step)
+      {
+         port->pwm_acc += port->ff_level;
+         port->pwm_on = port->pwm_acc >= FF_LEVEL_MAX;
+         if (port->pwm_on)
+            port->pwm_acc -= FF_LEVEL_MAX;
+      }
+      rumble[i+1] = port->pwm_on;
+   }
+   a->ff_changed = false;
+
+   if (!modulating)
+   {
+      a->pwm_next = INT64_MAX;
+   }
+   else if (step)
+   {
+      int64_t period = NSEC_PER_SEC / rumble_pwm_hz;
+      a->pwm_next = first_step ? now + period : a->pwm_next + period;
+      if (a->pwm_next <= now)
+         a->pwm_next = now + period;
+   }
+
+   if (memcmp(rumble, a->rumble, sizeof(rumble)) != 0)
+   {
+      memcpy(a->rumble, rumble, sizeof(rumble));
+      queue_rumble(a, rumble);
+   }
+}
+
+static void ff_arm_timer(struct adapter *a)
+{
+   int64_t deadline = ff_next_deadline(a);
+   if (deadline == a->ff_timer_armed)
+      return;
+
+   // an all-zero it_value disarms the timer
+   struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+   if (deadline != INT64_MAX)
+      its.it_value = ns_to_timespec(deadline > 0 ? deadline : 1);
+   timerfd_settime(a->ff_timer, TFD_TIMER_ABSTIME, &its, NULL);
+   a->ff_timer_armed = deadline;
+}
+
+static void ff_update(struct adapter *a, int64_t now)
+{
+   ff_run(a, now);
+   update_rumble(a, now);
+   if (single_thread)
+      ff_arm_timer(a);
+}
+
+static void ff_timer_handler(struct watch *w, uint32_t events)
+{
+   (void)events;
+   struct adapter *a = (struct adapter *)w->data;
+   uint64_t expirations;
+   if (read(a->ff_timer, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+      perror("timerfd read");
+   a->ff_timer_armed = INT64_MAX;
+   ff_update(a, now_ns());
+}
+
+// seqlock write, the only writer is whoever processes the adapter's reports
+static void shm_publish(struct adapter *a, int i, int64_t time)
+{
+   struct gc_shm_port *slot = &shm->ports[a->shm_index * 4 + i];
+   struct ports *port = &a->controllers[i];
+   uint32_t seq = slot->seq;
+   __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+   slot->connected = port->connected && !port->detached;
+   slot->type = port->type;
+   slot->extra_power = port->extra_power;
+   slot->buttons = port->report_buttons;
+   memcpy(slot->axis, port->axis, sizeof(slot->axis));
+   slot->report = a->report_seq;
+   slot->time = time;
+   __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// the group is the adapter's slot, so the segment numbers ports like the
+// devices do. The adapter that had the slot before gives the group back
+// when the hotplug worker frees it, which can be after this one started;
+// until then it's tried again on every report
+static void shm_claim_group(struct adapter *a)
+{
+   if (!__atomic_load_n(&shm_groups_used[a->slot], __ATOMIC_RELAXED)
+         && !__atomic_exchange_n(&shm_groups_used[a->slot], true, __ATOMIC_ACQ_REL))
+      a->shm_index = a->slot;
+}
+
+// decode a report into the ports' pending events, returns whether it
+// produced any
+static bool process_report(struct adapter *a, struct report *r)
+{
+   if (r->size != REPORT_SIZE || r->data[0] != 0x21)
+   {
+      count_add(&a->reports_invalid, 1);
+      return false;
+   }
+
+   if (a->last_report_time != 0)
+      sample_push(&a->proc_samples, METRIC_INTERVAL, r->time - a->last_report_time);
+   a->last_report_time = r->time;
+
+   unsigned changed = report_diff(a->last_report, r->data) | a->resync;
+   a->resync = 0;
+   memcpy(a->last_report, r->data, REPORT_SIZE);
+
+   bool decoded = false;
+   a->report_seq++;
+   if (shm != NULL && a->shm_index < 0)
+      shm_claim_group(a);
+   for (int i = 0; i < 4; i++)
+   {
+      struct ports *port = &a->controllers[i];
+      const struct port_map *map = __atomic_load_n(&port_maps[port->number], __ATOMIC_ACQUIRE);
+      if (port->map != map && switch_port_map(i, port, map))
+         changed |= 1 << i;
+      if (changed & (1 << i))
+         decoded |= handle_payload(i, port, &r->data[1 + i * 9], r->time);
+      if (port->detached && r->time >= port->detach_deadline)
+         disconnect_port(i, port);
+      if (shm != NULL && a->shm_index >= 0)
+         shm_publish(a, i, r->time);
+   }
+
+   ff_update(a, r->time);
+   return decoded;
+}
+
+// decode a batch of reports, then write each port's events at once
+static void process_reports(struct adapter *a, struct report *reports, int count)
+{
+   int64_t times[REPORT_QUEUE_SIZE];
+   int decoded = 0;
+   for (int k = 0; k < count; k++)
+   {
+      if (process_report(a, &reports[k]))
+         times[decoded++] = reports[k].time;
+   }
+
+   for (int i = 0; i < 4; i++)
+   {
+      struct ports *port = &a->controllers[i];
+      if (port->connected && port->pending_count > 0)
+         flush_port(port);
+   }
+
+   int64_t now = now_ns();
+   for (int k = 0; k < decoded; k++)
+      sample_push(&a->proc_samples, METRIC_LATENCY, now - times[k]);
+   count_add(&a->reports, count);
+}
+
+static void destroy_ports(struct adapter *a)
+{
+   for (int i = 0; i < 4; i++)
+   {
+      if (a->controllers[i].connected)
+      {
+         device_destroy(i, &a->controllers[i]);
+         ff_reset(&a->controllers[i]);
+      }
+   }
+}
+
+// hand a quitting adapter back to the hotplug worker waiting in close_adapter()
+static void release_adapter(struct io_thread *io, struct adapter *a)
+{
+   // parked devices are handed over by the hotplug worker
+   if (!a->parking)
+      destroy_ports(a);
+
+   pthread_mutex_lock(&io->lock);
+   for (int n = 0; n < io->adapter_count; n++)
+   {
+      if (io->adapters[n] == a)
+      {
+         io->adapters[n] = io->adapters[--io->adapter_count];
+         break;
+      }
+   }
+   a->released = true;
+   pthread_cond_broadcast(&io->released);
+   pthread_mutex_unlock(&io->lock);
+}
+
+static void *io_thread_main(void *data)
+{
+   struct io_thread *io = (struct io_thread *)data;
+   struct report batch[REPORT_QUEUE_SIZE];
+   struct adapter *list[MAX_ADAPTERS];
+   struct pollfd fds[1 + 4 * MAX_ADAPTERS];
+   struct ports *polled[1 + 4 * MAX_ADAPTERS];
+   int64_t last_poll = 0;
+
+   while (true)
+   {
+      // adapters come and go under the lock, the snapshot is only touched
+      // by this thread, which is the one that lets go of quitting adapters
+      pthread_mutex_lock(&io->lock);
+      int count = io->adapter_count;
+      memcpy(list, io->adapters, count * sizeof(list[0]));
+      bool stopping = io->stopping;
+      pthread_mutex_unlock(&io->lock);
+      if (stopping && count == 0)
+         break;
+
+      int total = 0;
+      struct adapter *busiest = NULL;
+      for (int n = 0; n < count; n++)
+      {
+         struct adapter *a = list[n];
+         int reports = 0;
+         pthread_mutex_lock(&a->queue_lock);
+         for (; a->queue_head != a->queue_tail; a->queue_head++)
+            batch[reports++] = a->queue[a->queue_head % REPORT_QUEUE_SIZE];
+         bool quitting = a->quitting;
+         // with the queue empty, the next report has to wake us up
+         a->thread_sleeping = reports == 0 && !quitting;
+         pthread_mutex_unlock(&a->queue_lock);
+         if (quitting)
+         {
+            release_adapter(io, a);
+            list[n] = NULL;
+            continue;
+         }
+
+         if (reports > 0)
+         {
+            process_reports(a, batch, reports);
+            if (busiest == NULL)
+               busiest = a;
+            total += reports;
+         }
+      }
+
+      // under a constant stream of reports, still look for force feedback
+      // requests every millisecond
+      int64_t now = now_ns();
+      if (total > 0 && now - last_poll < NSEC_PER_MSEC)
+         continue;
+
+      int nfds = 0;
+      fds[nfds].fd = io->wake_fd;
+      fds[nfds].events = POLLIN;
+      polled[nfds++] = NULL;
+      int64_t deadline = INT64_MAX;
+      for (int n = 0; n < count; n++)
+      {
+         struct adapter *a = list[n];
+         if (a == NULL)
+            continue;
+         for (int i = 0; i < 4; i++)
+         {
+            struct ports *port = &a->controllers[i];
+            if (!port->connected)
+               continue;
+            fds[nfds].fd = port->uinput;
+            fds[nfds].events = POLLIN;
+            polled[nfds++] = port;
+         }
+         int64_t next = ff_next_deadline(a);
+         if (next < deadline)
+            deadline = next;
+         if (busiest == NULL)
+            busiest = a;
+      }
+
+      // effects start and stop on their deadline, not on the next report
+      int timeout = 0;
+      if (total == 0)
+      {
+         timeout = deadline == INT64_MAX ? -1 : (int)((deadline - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC);
+         if (deadline != INT64_MAX && timeout < 0)
+            timeout = 0;
+      }
+      int ready = poll(fds, nfds, timeout);
+      unsigned syscalls = 1;
+      last_poll = now = now_ns();
+      if (ready < 0 && errno != EINTR)
+         perror("poll");
+
+      if (ready > 0 && (fds[0].revents & POLLIN))
+      {
+         uint64_t wakeups;
+         if (read(io->wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN)
+            perror("eventfd read");
+         syscalls++;
+      }
+      // the shared wakeup is charged to one adapter, the one that had work
+      // if any did
+      if (busiest != NULL)
+         add_syscalls(busiest, syscalls);
+
+      for (int k = 1; k < nfds && ready > 0; k++)
+      {
+         if (fds[k].revents & POLLIN)
+            service_ff(polled[k]->index, polled[k], now);
+      }
+      for (int n = 0; n < count; n++)
+      {
+         if (list[n] != NULL)
+            ff_update(list[n], now);
+      }
+   }
+
+   return NULL;
+}
+
+// the hotplug workers drop to SCHED_OTHER but share these locks with the
+// real-time threads, so with --rt-priority a preempted holder inherits the
+// waiter's priority instead of stalling input for as long as CFS likes
+static void init_lock(pthread_mutex_t *lock)
+{
+   pthread_mutexattr_t attr;
+   pthread_mutexattr_init(&attr);
+   if (rt_priority > 0)
+      pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+   pthread_mutex_init(lock, &attr);
+   pthread_mutexattr_destroy(&attr);
+}
+
+// up to io_thread_max threads are started as adapters arrive, after that
+// new adapters join the least loaded one
+static struct io_thread *assign_io_thread(struct adapter *a)
+{
+   struct io_thread *io = NULL;
+   int least = INT_MAX;
+   for (int k = 0; k < io_thread_count; k++)
+   {
+      pthread_mutex_lock(&io_threads[k].lock);
+      int load = io_threads[k].adapter_count;
+      pthread_mutex_unlock(&io_threads[k].lock);
+      if (load < least)
+      {
+         least = load;
+         io = &io_threads[k];
+      }
+   }
+
+   if ((io == NULL || least > 0) && io_thread_count < io_thread_max)
+   {
+      struct io_thread *spawned = &io_threads[io_thread_count];
+      spawned->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (spawned->wake_fd < 0)
+      {
+         perror("FATAL: eventfd() failed");
+         exit(-1);
+      }
+      init_lock(&spawned->lock);
+      pthread_cond_init(&spawned->released, NULL);
+      if (start_thread(&spawned->thread, io_thread_main, spawned) == 0)
+      {
+         io_thread_count++;
+         io = spawned;
+      }
+      else
+      {
+         perror("pthread_create");
+         close(spawned->wake_fd);
+         pthread_mutex_destroy(&spawned->lock);
+         pthread_cond_destroy(&spawned->released);
+      }
+   }
+   if (io == NULL)
+      return NULL;
+
+   a->wake_fd = io->wake_fd;
+   pthread_mutex_lock(&io->lock);
+   io->adapters[io->adapter_count++] = a;
+   pthread_mutex_unlock(&io->lock);
+   // so its ports are polled from now on
+   wake_io_thread(a);
+   return io;
+}
+
+static bool io_threads_init(void)
+{
+   if (io_thread_max == 0)
+   {
+      if (CPU_COUNT(&rt_cpus) > 0)
+         io_thread_max = CPU_COUNT(&rt_cpus);
+      else
+         io_thread_max = sysconf(_SC_NPROCESSORS_ONLN);
+      if (io_thread_max < 1)
+         io_thread_max = 1;
+   }
+   io_threads = calloc(io_thread_max, sizeof(struct io_thread));
+   if (io_threads == NULL)
+   {
+      fprintf(stderr, "FATAL: calloc() failed\n");
+      exit(-1);
+   }
+   return true;
+}
+
+// every adapter must already be released
+static void io_threads_exit(void)
+{
+   for (int k = 0; k < io_thread_count; k++)
+   {
+      struct io_thread *io = &io_threads[k];
+      uint64_t one = 1;
+      pthread_mutex_lock(&io->lock);
+      io->stopping = true;
+      pthread_mutex_unlock(&io->lock);
+      if (write(io->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+         perror("eventfd write");
+      pthread_join(io->thread, NULL);
+      close(io->wake_fd);
+      pthread_mutex_destroy(&io->lock);
+      pthread_cond_destroy(&io->released);
+   }
+   free(io_threads);
+   io_threads = NULL;
+   io_thread_count = 0;
+}
+
+// an adapter found at startup sent its first report, or never will
+static void startup_done(struct adapter *a, bool reported, int64_t now)
+{
+   static bool first_reported;
+   a->startup = false;
+   double msec = (now - startup_time) / (double)NSEC_PER_MSEC;
+   if (reported && !first_reported)
+   {
+      first_reported = true;
+      fprintf(stderr, "first report %.1f ms after startup\n", msec);
+   }
+   if (reported)
+      startup_reporting++;
+   if (--startup_pending == 0)
+      fprintf(stderr, "%d of %d adapters found at startup reporting %.1f ms after startup\n",
+            startup_reporting, startup_adapters, msec);
+}
+
+// called by the transport for every IN report
+static void adapter_report(struct adapter *a, const unsigned char *data, int size)
+{
+   int64_t now = now_ns();
+   if (a->capture != NULL)
+      capture_push(&a->capture->reports, a->capture_id, CAPTURE_REPORT, data, size, now);
+
+   if (a->startup)
+      startup_done(a, true, now);
+   if (a->recovery == RECOVERY_RESTARTED)
+   {
+      int64_t took = now - a->recovery_start;
+      a->recovery = RECOVERY_NONE;
+      a->recoveries++;
+      if (took > a->recovery_max)
+         a->recovery_max = took;
+      fprintf(stderr, "adapter %s recovered in %.1f ms (%d attempts)\n", a->name,
+            took / (double)NSEC_PER_MSEC, a->recovery_attempt + 1);
+   }
+
+   if (single_thread)
+   {
+      // no I/O thread, decode right here on the event loop
+      struct report r;
+      r.size = size;
+      r.time = now;
+      memcpy(r.data, data, sizeof(r.data));
+      if (!a->quitting)
+         process_reports(a, &r, 1);
+      return;
+   }
+
+   bool wake = false;
+   pthread_mutex_lock(&a->queue_lock);
+   if (a->queue_tail - a->queue_head < REPORT_QUEUE_SIZE)
+   {
+      struct report *r = &a->queue[a->queue_tail % REPORT_QUEUE_SIZE];
+      r->size = size;
+      r->time = now;
+      memcpy(r->data, data, sizeof(r->data));
+      a->queue_tail++;
+      // a busy I/O thread picks the report up without being woken
+      wake = a->thread_sleeping;
+      a->thread_sleeping = false;
+   }
+   else if (a->queue_dropped++ == 0)
+   {
+      fprintf(stderr, "adapter %s report queue overrun, dropping reports\n", a->name);
+   }
+   pthread_mutex_unlock(&a->queue_lock);
+
+   if (wake)
+   {
+      wake_io_thread(a);
+      add_syscalls(a, 1);
+   }
+}
+
+static void remove_adapter(struct adapter *old);
+
+static int64_t recovery_backoff(int attempt)
+{
+   int64_t msec = (int64_t)RECOVERY_BACKOFF_MIN_MSEC << attempt;
+   return (msec < RECOVERY_BACKOFF_MAX_MSEC ? msec : RECOVERY_BACKOFF_MAX_MSEC) * NSEC_PER_MSEC;
+}
+
+// schedule the next recovery attempt, or give the adapter up; main thread
+static void retry_recovery(struct adapter *a, int64_t now)
+{
+   if (a->recovery != RECOVERY_NONE)
+      a->recovery_attempt++;
+   else
+   {
+      a->recovery_attempt = 0;
+      a->recovery_start = now;
+   }
+
+   if (a->recovery_attempt >= MAX_RECOVERY_ATTEMPTS)
+   {
+      fprintf(stderr, "adapter %s did not recover after %d attempts\n", a->name, MAX_RECOVERY_ATTEMPTS);
+      a->recovery = RECOVERY_NONE;
+      remove_adapter(a);
+      return;
+   }
+   a->recovery = RECOVERY_WAIT;
+   a->recovery_due = now + recovery_backoff(a->recovery_attempt);
+}
+
+// a transfer failed: stop the adapter's transfers and restart it in place
+// once they're done, the virtual devices and the I/O thread carry on
+// untouched. Called on the main thread by the transport
+static void adapter_error(struct adapter *a, enum transfer_error kind)
+{
+   a->errors[kind]++;
+   // the cancelled transfers of a recovery report errors too
+   if (a->quitting || a->recovery == RECOVERY_WAIT || a->recovery == RECOVERY_BUSY)
+      return;
+
+   if (a->recovery == RECOVERY_NONE)
+      fprintf(stderr, "adapter %s: %s error, recovering\n", a->name, ERROR_NAMES[kind]);
+   retry_recovery(a, now_ns());
+   if (a->recovery != RECOVERY_WAIT)
+      return;
+   pause_rumble(a);
+   a->transport->stop(a);
+}
+
+static enum transfer_error usb_error_kind(enum libusb_transfer_status status)
+{
+   switch (status)
+   {
+   case LIBUSB_TRANSFER_TIMED_OUT:
+      return ERROR_TIMEOUT;
+   case LIBUSB_TRANSFER_STALL:
+      return ERROR_STALL;
+   case LIBUSB_TRANSFER_OVERFLOW:
+      return ERROR_OVERFLOW;
+   default:
+      return ERROR_IO;
+   }
+}
+
+// submitting only fails for good when the device is gone
+static void usb_submit_failed(struct adapter *a, int ret)
+{
+   fprintf(stderr, "libusb_submit_transfer: %s\n", libusb_error_name(ret));
+   if (ret == LIBUSB_ERROR_NO_DEVICE)
+   {
+      a->parking = replug_grace_msec > 0 && !quitting;
+      stop_adapter(a);
+   }
+   else
+   {
+      adapter_error(a, ERROR_SUBMIT);
+   }
+}
+
+static void LIBUSB_CALL in_transfer_callback(struct libusb_transfer *transfer)
+{
+   struct adapter *a = (struct adapter *)transfer->user_data;
+
+   if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+   {
+      adapter_report(a, transfer->buffer, transfer->actual_length);
+   }
+   else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE && !a->quitting)
+   {
+      // unplugged, the LEAVE event follows; its controllers may come back
+      a->parking = replug_grace_msec > 0 && !quitting;
+      stop_adapter(a);
+   }
+   else if (transfer->status != LIBUSB_TRANSFER_CANCELLED)
+   {
+      if (verbose)
+         fprintf(stderr, "libusb IN transfer error %d\n", transfer->status);
+      adapter_error(a, usb_error_kind(transfer->status));
+   }
+
+   if (transfer->status == LIBUSB_TRANSFER_COMPLETED && !a->quitting && a->recovery != RECOVERY_WAIT)
+   {
+      int ret = libusb_submit_transfer(transfer);
+      if (ret == 0)
+         return;
+      a->transfers_pending--;
+      usb_submit_failed(a, ret);
+      return;
+   }
+
+   a->transfers_pending--;
+}
+
+static void LIBUSB_CALL rumble_transfer_callback(struct libusb_transfer *transfer)
+{
+   struct adapter *a = (struct adapter *)transfer->user_data;
+
+   if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+   {
+      rumble_done(a, TRANSFER_OK);
+   }
+   else if (transfer->status == LIBUSB_TRANSFER_CANCELLED || a->quitting)
+   {
+      rumble_done(a, TRANSFER_CANCELLED);
+   }
+   else
+   {
+      if (verbose)
+         fprintf(stderr, "libusb OUT transfer error %d\n", transfer->status);
+      // held before it's marked done, or the I/O thread could send the next
+      // state into the failing endpoint in between
+      pause_rumble(a);
+      rumble_done(a, TRANSFER_FAILED);
+      if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+         stop_adapter(a);
+      else
+         adapter_error(a, usb_error_kind(transfer->status));
+   }
+}
+
+static void LIBUSB_CALL init_transfer_callback(struct libusb_transfer *transfer)
+{
+   struct adapter *a = (struct adapter *)transfer->user_data;
+
+   a->transfers_pending--;
+
+   // cancelled by whoever stopped the adapter
+   if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+      return;
+   if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+   {
+      stop_adapter(a);
+      return;
+   }
+   if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+   {
+      fprintf(stderr, "adapter init transfer error %d\n", transfer->status);
+      adapter_error(a, usb_error_kind(transfer->status));
+      return;
+   }
+   if (transfer->actual_length != transfer->length) {
+      fprintf(stderr, "adapter init %d/%d bytes transferred.\n", transfer->actual_length, transfer->length);
+      adapter_error(a, ERROR_IO);
+      return;
+   }
+
+   // keep several IN transfers queued so the host controller always has one
+   // to fill on the next polling interval
+   for (int i = 0; i < num_in_transfers && !a->quitting && a->recovery != RECOVERY_WAIT; i++)
+   {
+      int ret = libusb_submit_transfer(a->in_transfers[i]);
+      if (ret != 0)
+      {
+         usb_submit_failed(a, ret);
+         break;
+      }
+      a->transfers_pending++;
+   }
+}
+
+static bool usb_start(struct adapter *a)
+{
+   a->init_payload[0] = 0x13;
+   libusb_fill_interrupt_transfer(a->init_transfer, a->handle, EP_OUT, a->init_payload, sizeof(a->init_payload), init_transfer_callback, a, 0);
+   for (int i = 0; i < num_in_transfers; i++)
+      libusb_fill_interrupt_transfer(a->in_transfers[i], a->handle, EP_IN, a->in_buffers[i], REPORT_SIZE, in_transfer_callback, a, 0);
+   libusb_fill_interrupt_transfer(a->rumble_transfer, a->handle, EP_OUT, a->rumble_buffer, sizeof(a->rumble_buffer), rumble_transfer_callback, a, 0);
+
+   int ret = libusb_submit_transfer(a->init_transfer);
+   if (ret != 0)
+   {
+      fprintf(stderr, "libusb_submit_transfer: %s\n", libusb_error_name(ret));
+      return false;
+   }
+   a->transfers_pending++;
+   return true;
+}
+
+static bool usb_write_rumble(struct adapter *a)
+{
+   int ret = libusb_submit_transfer(a->rumble_transfer);
+   if (ret != 0)
+   {
+      fprintf(stderr, "libusb_submit_transfer: %s\n", libusb_error_name(ret));
+      return false;
+   }
+   return true;
+}
+
+static void usb_stop(struct adapter *a)
+{
+   libusb_cancel_transfer(a->init_transfer);
+   for (int i = 0; i < num_in_transfers; i++)
+      libusb_cancel_transfer(a->in_transfers[i]);
+   pthread_mutex_lock(&a->rumble_lock);
+   if (a->rumble_in_flight)
+      libusb_cancel_transfer(a->rumble_transfer);
+   pthread_mutex_unlock(&a->rumble_lock);
+}
+
+static bool usb_idle(struct adapter *a)
+{
+   return a->transfers_pending == 0;
+}
+
+// runs on the hotplug worker; a halted endpoint usually just needs the
+// halt cleared, after that the device is reset, which keeps the claimed
+// interface as long as it comes back the same. start() sends the init
+// command again either way
+static bool usb_recover(struct adapter *a, int attempt)
+{
+   int ret;
+   if (attempt == 0)
+   {
+      ret = libusb_clear_halt(a->handle, EP_IN);
+      if (ret == 0)
+         ret = libusb_clear_halt(a->handle, EP_OUT);
+      if (ret == 0)
+         return true;
+      fprintf(stderr, "adapter %s: clearing halt failed: %s\n", a->name, libusb_error_name(ret));
+   }
+   ret = libusb_reset_device(a->handle);
+   if (ret == 0)
+      return true;
+   fprintf(stderr, "adapter %s: reset failed: %s\n", a->name, libusb_error_name(ret));
+   return false;
+}
+
+static void usb_close(struct adapter *a)
+{
+   if (a->claimed)
+      libusb_release_interface(a->handle, 0);
+   if (a->handle != NULL)
+      libusb_close(a->handle);
+   libusb_free_transfer(a->init_transfer);
+   libusb_free_transfer(a->rumble_transfer);
+   for (int i = 0; i < num_in_transfers; i++)
+      libusb_free_transfer(a->in_transfers[i]);
+   libusb_unref_device(a->device);
+}
+
+// runs on the hotplug worker, opening can take a while
+static bool usb_open(struct adapter *a)
+{
+   int ret = libusb_open(a->device, &a->handle);
+   if (ret != 0)
+   {
+      fprintf(stderr, "Error opening device %s: %s\n", a->name, libusb_error_name(ret));
+      return false;
+   }
+
+   if (libusb_kernel_driver_active(a->handle, 0) == 1) {
+       fprintf(stderr, "Detaching kernel driver\n");
+       if (libusb_detach_kernel_driver(a->handle, 0)) {
+           fprintf(stderr, "Error detaching handle %p from kernel\n", a->handle);
+           return false;
+       }
+   }
+
+   ret = libusb_claim_interface(a->handle, 0);
+   if (ret != 0)
+   {
+      fprintf(stderr, "Error claiming interface of %s: %s\n", a->name, libusb_error_name(ret));
+      return false;
+   }
+   a->claimed = true;
+   return true;
+}
+
+static const struct transport usb_transport = {
+   "usb",
+   usb_start,
+   usb_write_rumble,
+   usb_stop,
+   usb_idle,
+   usb_close,
+   usb_recover,
+};
+
+static bool adapter_idle(struct adapter *a)
+{
+   pthread_mutex_lock(&a->rumble_lock);
+   bool idle = a->transport->idle(a) && !a->rumble_in_flight;
+   pthread_mutex_unlock(&a->rumble_lock);
+   return idle;
+}
+
+static void free_adapter(struct adapter *a)
+{
+   if (a->shm_index >= 0)
+   {
+      // the I/O thread let go of it, so this is the only writer now
+      for (int i = 0; i < 4; i++)
+      {
+         a->controllers[i].connected = false;
+         shm_publish(a, i, now_ns());
+      }
+      __atomic_store_n(&shm_groups_used[a->shm_index], false, __ATOMIC_RELEASE);
+   }
+   a->transport->close(a);
+   if (a->capture != NULL)
+      capture_release_id(a->capture_id);
+   if (a->ff_timer >= 0)
+   {
+      watch_remove(&a->ff_timer_watch);
+      close(a->ff_timer);
+   }
+   for (int i = 0; i < 4; i++)
+   {
+      free(a->controllers[i].ff_events);
+      set_port_map(&a->controllers[i], NULL);
+   }
+   free(a->ff_heap);
+   pthread_mutex_destroy(&a->queue_lock);
+   pthread_mutex_destroy(&a->rumble_lock);
+   free(a);
+}
+
+static struct adapter *create_adapter(const struct transport *transport)
+{
+   struct adapter *a = calloc(1, sizeof(struct adapter));
+   if (a == NULL)
+   {
+      fprintf(stderr, "FATAL: calloc() failed\n");
+      exit(-1);
+   }
+   a->transport = transport;
+   a->slot = -1;
+   a->shm_index = -1;
+   a->capture_id = -1;
+   if (startup_scanning)
+   {
+      a->startup = true;
+      startup_adapters++;
+      startup_pending++;
+   }
+   a->ff_timer = -1;
+   a->ff_timer_armed = INT64_MAX;
+   a->pwm_next = INT64_MAX;
+   a->level_next = INT64_MAX;
+   a->ff_heap = calloc(4 * ff_effects_max, sizeof(struct ff_event *));
+   if (a->ff_heap == NULL)
+   {
+      fprintf(stderr, "FATAL: calloc() failed\n");
+      exit(-1);
+   }
+   for (int i = 0; i < 4; i++)
+   {
+      struct ports *port = &a->controllers[i];
+      port->index = i;
+      port->number = i;
+      port->adapter = a;
+      set_port_map(port, __atomic_load_n(&port_maps[i], __ATOMIC_ACQUIRE));
+      port->ff_events = calloc(ff_effects_max, sizeof(struct ff_event));
+      if (port->ff_events == NULL)
+      {
+         fprintf(stderr, "FATAL: calloc() failed\n");
+         exit(-1);
+      }
+      for (int j = 0; j < ff_effects_max; j++)
+      {
+         port->ff_events[j].heap_index = -1;
+         port->ff_events[j].port = port;
+      }
+   }
+
+   // the I/O thread's, once the adapter is given one
+   a->wake_fd = -1;
+   init_lock(&a->queue_lock);
+   init_lock(&a->rumble_lock);
+   return a;
+}
+
+// the slot the location had last time, else one no location has had,
+// else any free one; -1 when all are taken
+static int claim_slot(const char *name)
+{
+   int slot = -1;
+   for (int n = 0; n < MAX_ADAPTERS && slot < 0; n++)
+   {
+      if (!slot_used[n] && strcmp(slot_locations[n], name) == 0)
+         slot = n;
+   }
+   for (int n = 0; n < MAX_ADAPTERS && slot < 0; n++)
+   {
+      if (!slot_used[n] && slot_locations[n][0] == '\0')
+         slot = n;
+   }
+   for (int n = 0; n < MAX_ADAPTERS && slot < 0; n++)
+   {
+      if (!slot_used[n])
+         slot = n;
+   }
+   if (slot >= 0)
+   {
+      slot_used[slot] = true;
+      snprintf(slot_locations[slot], sizeof(slot_locations[slot]), "%s", name);
+   }
+   return slot;
+}
+
+// start the transport and hook the adapter up; frees it on failure
+static bool start_adapter(struct adapter *a)
+{
+   // USB adapters claim theirs when found, so the ones opened in parallel
+   // at startup are numbered in the order they were found
+   if (a->slot < 0)
+      a->slot = claim_slot(a->name);
+   if (a->slot < 0)
+   {
+      fprintf(stderr, "ignoring adapter %s, already running %d\n", a->name, MAX_ADAPTERS);
+      if (a->startup)
+         startup_done(a, false, now_ns());
+      destroy_ports(a);
+      free_adapter(a);
+      return false;
+   }
+   // the ports take their slot's calibration and maps, the maps on the
+   // first report
+   for (int i = 0; i < 4; i++)
+      a->controllers[i].number = a->slot * 4 + i;
+
+   // before the transport starts delivering reports
+   if (capture_file != NULL && (a->capture_id = capture_claim_id()) >= 0)
+      a->capture = capture_streams[a->capture_id];
+
+   if (!a->transport->start(a))
+   {
+      slot_used[a->slot] = false;
+      if (a->startup)
+         startup_done(a, false, now_ns());
+      destroy_ports(a);
+      free_adapter(a);
+      return false;
+   }
+
+   if (single_thread)
+   {
+      a->ff_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+      if (a->ff_timer < 0)
+      {
+         perror("timerfd_create");
+      }
+      else
+      {
+         a->ff_timer_watch.fd = a->ff_timer;
+         a->ff_timer_watch.handler = ff_timer_handler;
+         a->ff_timer_watch.data = a;
+         watch_add(&a->ff_timer_watch, EPOLLIN);
+      }
+   }
+
+   // adopted devices from a replug are already there
+   for (int i = 0; i < 4 && precreate_ports; i++)
+   {
+      struct ports *port = &a->controllers[i];
+      if (!port->connected && device_create(i, port, STATE_NORMAL))
+      {
+         port->detached = true;
+         port->detach_deadline = INT64_MAX;
+      }
+   }
+
+   if (shm != NULL)
+      shm_claim_group(a);
+
+   a->list_index = adapter_count;
+   adapter_list[adapter_count++] = a;
+
+   fprintf(stderr, "adapter %s connected, ports %d-%d\n", a->name, a->slot * 4 + 1, a->slot * 4 + 4);
+   if (!single_thread && (a->io = assign_io_thread(a)) == NULL)
+   {
+      fprintf(stderr, "no I/O thread for adapter %s\n", a->name);
+      remove_adapter(a);
+      return false;
+   }
+   return true;
+}
+
+static void adapter_queue_push(struct adapter_queue *q, struct adapter *a)
+{
+   a->job_next = NULL;
+   if (q->head == NULL)
+      q->head = a;
+   else
+      q->tail->job_next = a;
+   q->tail = a;
+}
+
+static struct adapter *adapter_queue_pop(struct adapter_queue *q)
+{
+   struct adapter *a = q->head;
+   if (a != NULL)
+   {
+      q->head = a->job_next;
+      if (q->head == NULL)
+         q->tail = NULL;
+   }
+   return a;
+}
+
+// call with hotplug_lock held
+static void queue_hotplug_job(struct adapter *a, enum hotplug_job job)
+{
+   a->job = job;
+   adapter_queue_push(&hotplug_jobs, a);
+   pthread_cond_signal(&hotplug_cond);
+}
+
+static void post_hotplug_job(struct adapter *a, enum hotplug_job job)
+{
+   pthread_mutex_lock(&hotplug_lock);
+   queue_hotplug_job(a, job);
+   pthread_mutex_unlock(&hotplug_lock);
+}
+
+// move the virtual devices of a removed adapter to parked_ports, false if
+// there are none worth keeping
+static bool park_ports(struct adapter *a)
+{
+   bool any = false;
+   for (int i = 0; i < 4; i++)
+      any |= a->controllers[i].connected;
+   if (!any)
+      return false;
+
+   struct parked_ports *p = calloc(1, sizeof(struct parked_ports));
+   if (p == NULL)
+   {
+      fprintf(stderr, "FATAL: calloc() failed\n");
+      exit(-1);
+   }
+   snprintf(p->name, sizeof(p->name), "%s", a->name);
+   p->expires = now_ns() + replug_grace_msec * NSEC_PER_MSEC;
+   for (int i = 0; i < 4; i++)
+   {
+      struct ports *port = &a->controllers[i];
+      // uploaded effects survive the replug, playing ones are stopped
+      for (int j = 0; j < ff_effects_max; j++)
+         ff_stop(a, &port->ff_events[j]);
+      port->ff_level = 0;
+      port->pwm_acc = 0;
+      port->pwm_on = false;
+      p->ports[i] = *port;
+      port->ff_events = NULL;
+      port->map = NULL;
+      port->connected = false;
+   }
+
+   pthread_mutex_lock(&hotplug_lock);
+   p->next = parked_ports;
+   parked_ports = p;
+   pthread_mutex_unlock(&hotplug_lock);
+   fprintf(stderr, "adapter %s: keeping its controllers for %d ms\n", a->name, replug_grace_msec);
+   return true;
+}
+
+static void destroy_parked_ports(struct parked_ports *p)
+{
+   for (int i = 0; i < 4; i++)
+   {
+      if (p->ports[i].connected)
+         device_destroy(i, &p->ports[i]);
+      free(p->ports[i].ff_events);
+      set_port_map(&p->ports[i], NULL);
+   }
+   free(p);
+}
+
+// the blocking half of the teardown, on the hotplug worker once the main
+// loop is done with the adapter
+static void close_adapter(struct adapter *a)
+{
+   if (a->io != NULL)
+   {
+      pthread_mutex_lock(&a->io->lock);
+      while (!a->released)
+         pthread_cond_wait(&a->io->released, &a->io->lock);
+      pthread_mutex_unlock(&a->io->lock);
+   }
+   if (!a->parking || !park_ports(a))
+      destroy_ports(a);
+   free_adapter(a);
+}
+
+// whether an adapter at this location is still draining its transfers,
+// waiting to be closed or being closed; call with hotplug_lock held
+static bool close_pending(const char *name)
+{
+   for (struct adapter *a = dying_adapters; a != NULL; a = a->next)
+   {
+      if (strcmp(a->name, name) == 0)
+         return true;
+   }
+   for (int k = 0; k < HOTPLUG_WORKERS; k++)
+   {
+      if (strcmp(hotplug_closing[k], name) == 0)
+         return true;
+   }
+   for (struct adapter *a = hotplug_jobs.head; a != NULL; a = a->job_next)
+   {
+      if (a->job == JOB_CLOSE && strcmp(a->name, name) == 0)
+         return true;
+   }
+   return false;
+}
+
+// hand finished jobs to the main loop. An adapter plugged straight back in
+// waits until its old self has parked the virtual devices it's going to
+// take over; call with hotplug_lock held
+static void pass_finished_jobs(void)
+{
+   bool passed = false;
+   struct adapter **p = &hotplug_finished;
+   while (*p != NULL)
+   {
+      struct adapter *a = *p;
+      if (a->job == JOB_OPEN && !a->open_failed && close_pending(a->name))
+      {
+         p = &a->job_next;
+         continue;
+      }
+      *p = a->job_next;
+      adapter_queue_push(&hotplug_opened, a);
+      passed = true;
+   }
+
+   uint64_t one = 1;
+   if (passed && write(hotplug_watch.fd, &one, sizeof(one)) < 0)
+      perror("eventfd write");
+}
+
+static void *hotplug_worker(void *data)
+{
+   int index = (int)(intptr_t)data;
+   // device setup shouldn't compete with the real-time I/O threads
+   if (rt_priority > 0)
+   {
+      struct sched_param param = { .sched_priority = 0 };
+      pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+   }
+
+   pthread_mutex_lock(&hotplug_lock);
+   while (true)
+   {
+      struct adapter *a = adapter_queue_pop(&hotplug_jobs);
+      if (a != NULL)
+      {
+         enum hotplug_job job = a->job;
+         if (job == JOB_CLOSE)
+            snprintf(hotplug_closing[index], sizeof(hotplug_closing[index]), "%s", a->name);
+         pthread_mutex_unlock(&hotplug_lock);
+
+         bool ok = true;
+         if (job == JOB_OPEN)
+            ok = usb_open(a);
+         else if (job == JOB_RECOVER)
+            ok = a->transport->recover(a, a->recovery_attempt);
+         else
+            close_adapter(a);
+
+         pthread_mutex_lock(&hotplug_lock);
+         if (job == JOB_CLOSE)
+         {
+            hotplug_closing[index][0] = '\0';
+         }
+         else
+         {
+            if (job == JOB_OPEN)
+               a->open_failed = !ok;
+            else
+               a->recover_failed = !ok;
+            a->job_next = hotplug_finished;
+            hotplug_finished = a;
+         }
+         pass_finished_jobs();
+         continue;
+      }
+
+      // parked devices whose adapter didn't come back in time, or all of
+      // them when shutting down
+      int64_t now = now_ns();
+      int64_t next_expiry = INT64_MAX;
+      struct parked_ports *expired = NULL;
+      struct parked_ports **p = &parked_ports;
+      while (*p != NULL)
+      {
+         struct parked_ports *entry = *p;
+         if (hotplug_stopping || entry->expires <= now)
+         {
+            *p = entry->next;
+            entry->next = expired;
+            expired = entry;
+            continue;
+         }
+         if (entry->expires < next_expiry)
+            next_expiry = entry->expires;
+         p = &entry->next;
+      }
+      if (expired != NULL)
+      {
+         bool stopping = hotplug_stopping;
+         pthread_mutex_unlock(&hotplug_lock);
+         while (expired != NULL)
+         {
+            struct parked_ports *next = expired->next;
+            if (!stopping)
+               fprintf(stderr, "adapter %s did not come back\n", expired->name);
+            destroy_parked_ports(expired);
+            expired = next;
+         }
+         pthread_mutex_lock(&hotplug_lock);
+         continue;
+      }
+
+      if (hotplug_stopping)
+         break;
+      if (next_expiry == INT64_MAX)
+      {
+         pthread_cond_wait(&hotplug_cond, &hotplug_lock);
+      }
+      else
+      {
+         struct timespec ts = ns_to_timespec(next_expiry);
+         pthread_cond_timedwait(&hotplug_cond, &hotplug_lock, &ts);
+      }
+   }
+   pthread_mutex_unlock(&hotplug_lock);
+   return NULL;
+}
+
+// hand the virtual devices parked under the adapter's name back to it
+static void adopt_parked_ports(struct adapter *a)
+{
+   struct parked_ports *p = NULL;
+   pthread_mutex_lock(&hotplug_lock);
+   for (struct parked_ports **pp = &parked_ports; *pp != NULL; pp = &(*pp)->next)
+   {
+      if (strcmp((*pp)->name, a->name) == 0)
+      {
+         p = *pp;
+         *pp = p->next;
+         break;
+      }
+   }
+   pthread_mutex_unlock(&hotplug_lock);
+   if (p == NULL)
+      return;
+
+   for (int i = 0; i < 4; i++)
+   {
+      struct ports *port = &a->controllers[i];
+      free(port->ff_events);
+      set_port_map(port, NULL);
+      *port = p->ports[i];
+      port->adapter = a;
+      for (int j = 0; j < ff_effects_max; j++)
+         port->ff_events[j].port = port;
+      if (single_thread && port->connected)
+      {
+         port->ff_watch.data = port;
+         watch_add(&port->ff_watch, EPOLLIN);
+      }
+   }
+   free(p);
+   fprintf(stderr, "adapter %s came back, reusing its controllers\n", a->name);
+}
+
+// the worker's recover() is done, start the adapter again or try later
+static void finish_recovery(struct adapter *a)
+{
+   // removed meanwhile, reap_adapters() can close it now
+   if (a->quitting)
+   {
+      a->recovery = RECOVERY_NONE;
+      return;
+   }
+   if (a->recover_failed)
+   {
+      retry_recovery(a, now_ns());
+      return;
+   }
+
+   a->recovery = RECOVERY_RESTARTED;
+   resume_rumble(a);
+   if (!a->transport->start(a))
+      adapter_error(a, ERROR_SUBMIT);
+}
+
+// adapters whose transfers drained and whose backoff ran out go to the
+// worker; the timer wakes the loop for the next one due
+static void service_recovery(void)
+{
+   int64_t now = now_ns();
+   int64_t next_due = INT64_MAX;
+   for (int n = 0; n < adapter_count; n++)
+   {
+      struct adapter *a = adapter_list[n];
+      if (__atomic_exchange_n(&a->rumble_failed, false, __ATOMIC_ACQ_REL))
+         adapter_error(a, ERROR_SUBMIT);
+      if (a->recovery != RECOVERY_WAIT)
+         continue;
+      if (a->recovery_due > now)
+      {
+         if (a->recovery_due < next_due)
+            next_due = a->recovery_due;
+         continue;
+      }
+      // still in flight ones finish in a callback, which runs this again
+      if (!adapter_idle(a))
+         continue;
+      a->recovery = RECOVERY_BUSY;
+      post_hotplug_job(a, JOB_RECOVER);
+   }
+
+   if (next_due != recovery_timer_armed)
+   {
+      struct itimerspec spec;
+      memset(&spec, 0, sizeof(spec));
+      if (next_due != INT64_MAX)
+         spec.it_value = ns_to_timespec(next_due);
+      if (timerfd_settime(recovery_watch.fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0)
+         perror("timerfd_settime");
+      recovery_timer_armed = next_due;
+   }
+}
+
+static void recovery_timer_handler(struct watch *w, uint32_t events)
+{
+   (void)events;
+   uint64_t expirations;
+   if (read(w->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+      perror("timerfd read");
+   recovery_timer_armed = INT64_MAX;
+   service_recovery();
+}
+
+// adapters the worker finished opening or recovering
+static void hotplug_watch_handler(struct watch *w, uint32_t events)
+{
+   (void)events;
+   uint64_t count;
+   if (read(w->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+      perror("eventfd read");
+
+   pthread_mutex_lock(&hotplug_lock);
+   struct adapter_queue opened = hotplug_opened;
+   hotplug_opened.head = hotplug_opened.tail = NULL;
+   pthread_mutex_unlock(&hotplug_lock);
+
+   struct adapter *a;
+   while ((a = adapter_queue_pop(&opened)) != NULL)
+   {
+      if (a->job == JOB_RECOVER)
+      {
+         finish_recovery(a);
+         continue;
+      }
+
+      for (struct adapter **p = &opening_adapters; *p != NULL; p = &(*p)->next)
+      {
+         if (*p == a)
+         {
+            *p = a->next;
+            break;
+         }
+      }
+
+      if (a->open_failed || a->open_cancelled || quitting)
+      {
+         if (a->startup)
+            startup_done(a, false, now_ns());
+         if (a->slot >= 0)
+            slot_used[a->slot] = false;
+         post_hotplug_job(a, JOB_CLOSE);
+         continue;
+      }
+      adopt_parked_ports(a);
+      start_adapter(a);
+   }
+}
+
+static bool hotplug_init(void)
+{
+   hotplug_watch.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (hotplug_watch.fd < 0)
+   {
+      perror("eventfd");
+      return false;
+   }
+   hotplug_watch.handler = hotplug_watch_handler;
+   watch_add(&hotplug_watch, EPOLLIN);
+
+   recovery_watch.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+   if (recovery_watch.fd < 0)
+   {
+      perror("timerfd_create");
+      return false;
+   }
+   recovery_watch.handler = recovery_timer_handler;
+   watch_add(&recovery_watch, EPOLLIN);
+
+   init_lock(&hotplug_lock);
+   pthread_condattr_t cond_attr;
+   pthread_condattr_init(&cond_attr);
+   pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+   pthread_cond_init(&hotplug_cond, &cond_attr);
+   pthread_condattr_destroy(&cond_attr);
+   for (int k = 0; k < HOTPLUG_WORKERS; k++)
+   {
+      if (start_thread(&hotplug_threads[k], hotplug_worker, (void *)(intptr_t)k) != 0)
+      {
+         perror("pthread_create");
+         break;
+      }
+      hotplug_worker_count++;
+   }
+   return hotplug_worker_count > 0;
+}
+
+// finishes the queued jobs and destroys whatever is still parked
+static void hotplug_exit(void)
+{
+   pthread_mutex_lock(&hotplug_lock);
+   hotplug_stopping = true;
+   pthread_cond_broadcast(&hotplug_cond);
+   pthread_mutex_unlock(&hotplug_lock);
+   for (int k = 0; k < hotplug_worker_count; k++)
+      pthread_join(hotplug_threads[k], NULL);
+   hotplug_worker_count = 0;
+   watch_remove(&hotplug_watch);
+   close(hotplug_watch.fd);
+   watch_remove(&recovery_watch);
+   close(recovery_watch.fd);
+}
+
+// name an adapter after the physical port it's plugged into, so it's
+// recognized when it comes back
+static void usb_location(struct libusb_device *dev, char *name, size_t size)
+{
+   uint8_t ports[8];
+   int count = libusb_get_port_numbers(dev, ports, sizeof(ports));
+   if (count <= 0)
+   {
+      snprintf(name, size, "%p", (void *)dev);
+      return;
+   }
+
+   int len = snprintf(name, size, "%d-", libusb_get_bus_number(dev));
+   for (int i = 0; i < count && len < (int)size; i++)
+      len += snprintf(name + len, size - len, i == 0 ? "%d" : ".%d", ports[i]);
+}
+
+// the device is opened on the hotplug worker, hotplug_watch_handler() then
+// starts the adapter
+static void add_adapter(struct libusb_device *dev)
+{
+   struct adapter *a = create_adapter(&usb_transport);
+   a->device = libusb_ref_device(dev);
+   usb_location(dev, a->name, sizeof(a->name));
+
+   bool alloc_failed = (a->init_transfer = libusb_alloc_transfer(0)) == NULL;
+   alloc_failed |= (a->rumble_transfer = libusb_alloc_transfer(0)) == NULL;
+   for (int i = 0; i < num_in_transfers; i++)
+      alloc_failed |= (a->in_transfers[i] = libusb_alloc_transfer(0)) == NULL;
+   if (alloc_failed)
+   {
+      fprintf(stderr, "FATAL: libusb_alloc_transfer() failed\n");
+      exit(-1);
+   }
+
+   a->slot = claim_slot(a->name);
+   a->next = opening_adapters;
+   opening_adapters = a;
+   post_hotplug_job(a, JOB_OPEN);
+}
+
+static void remove_adapter(struct adapter *old)
+{
+   int n = old->list_index;
+   if (n >= adapter_count || adapter_list[n] != old)
+      return;
+   adapter_list[n] = adapter_list[--adapter_count];
+   adapter_list[n]->list_index = n;
+   slot_used[old->slot] = false;
+   if (old->startup)
+      startup_done(old, false, now_ns());
+
+   // a USB adapter that's unplugged may be right back, e.g. after a
+   // bumped cable; its virtual devices wait for it
+   if (old->transport == &usb_transport && replug_grace_msec > 0 && !quitting)
+      old->parking = true;
+   stop_adapter(old);
+   old->transport->stop(old);
+
+   // this usually runs inside a libusb callback, so the cancelled
+   // transfers can't be reaped here; reap_adapters() finishes the job
+   pthread_mutex_lock(&hotplug_lock);
+   old->next = dying_adapters;
+   dying_adapters = old;
+   pthread_mutex_unlock(&hotplug_lock);
+}
+
+static void remove_usb_adapter(struct libusb_device *dev)
+{
+   for (int n = 0; n < adapter_count; n++)
+   {
+      struct adapter *a = adapter_list[n];
+      if (a->transport == &usb_transport && a->device == dev)
+      {
+         remove_adapter(a);
+         return;
+      }
+   }
+   // left before the worker got it open, dropped once it's done
+   for (struct adapter *a = opening_adapters; a != NULL; a = a->next)
+   {
+      if (a->device == dev)
+         a->open_cancelled = true;
+   }
+}
+
+struct synthetic
+{
+   // reports only flow between start and stop, like an initialized adapter
+   bool running;
+   // the last rumble write completes on the next tick, under rumble_lock
+   bool rumble_pending;
+   uint64_t rumble_writes;
+   uint64_t tick;
+   size_t cursor;
+   // ports with a virtual controller plugged in
+   unsigned char plugged;
+   // recovery attempts that fail after an injected fault
+   int failing_attempts;
+   // the next rumble write fails to submit, under rumble_lock
+   bool failing_write;
+   // what the motors were last told, all off again after a recovery
+   unsigned char motors[4];
+};
+
+static uint32_t synthetic_random(void)
+{
+   // xorshift32, reproducible from run to run
+   synthetic_seed ^= synthetic_seed << 13;
+   synthetic_seed ^= synthetic_seed >> 17;
+   synthetic_seed ^= synthetic_seed << 5;
+   return synthetic_seed;
+}
+
+static bool synthetic_start(struct adapter *a)
+{
+   a->synthetic->running = true;
+   return true;
+}
+
+static bool synthetic_write_rumble(struct adapter *a)
+{
+   struct synthetic *s = a->synthetic;
+   if (s->failing_write)
+   {
+      s->failing_write = false;
+      return false;
+   }
+   s->rumble_pending = true;
+   s->rumble_writes++;
+   memcpy(s->motors, &a->rumble_buffer[1], sizeof(s->motors));
+   return true;
+}
+
+static void synthetic_stop(struct adapter *a)
+{
+   struct synthetic *s = a->synthetic;
+   s->running = false;
+
+   pthread_mutex_lock(&a->rumble_lock);
+   bool cancelled = s->rumble_pending;
+   s->rumble_pending = false;
+   pthread_mutex_unlock(&a->rumble_lock);
+   if (cancelled)
+      rumble_done(a, TRANSFER_CANCELLED);
+}
+
+static bool synthetic_idle(struct adapter *a)
+{
+   return !a->synthetic->running && !a->synthetic->rumble_pending;
+}
+
+static void synthetic_close(struct adapter *a)
+{
+   free(a->synthetic);
+}
+
+// on the hotplug worker, takes a moment like a real device would
+static bool synthetic_recover(struct adapter *a, int attempt)
+{
+   usleep(1000);
+   memset(a->synthetic->motors, 0, sizeof(a->synthetic->motors));
+   return attempt >= a->synthetic->failing_attempts;
+}
+
+static const struct transport synthetic_transport = {
+   "synthetic",
+   synthetic_start,
+   synthetic_write_rumble,
+   synthetic_stop,
+   synthetic_idle,
+   synthetic_close,
+   synthetic_recover,
+};
+
+// 0..255..0 over 512 steps
+static unsigned char triangle(uint64_t t)
+{
+   unsigned v = t & 511;
+   return v < 256 ? v : 511 - v;
+}
+
+static void synthetic_report(struct synthetic *s, unsigned char *data)
+{
+   if (synthetic_reports != NULL)
+   {
+      memcpy(data, &synthetic_reports[s->cursor * REPORT_SIZE], REPORT_SIZE);
+      s->cursor = (s->cursor + 1) % synthetic_report_count;
+      for (int i = 0; i < 4; i++)
+      {
+         if (!(s->plugged & (1 << i)))
+            data[1 + 9 * i] = 0;
+      }
+      return;
+   }
+
+   uint64_t t = s->tick;
+   data[0] = 0x21;
+   for (int i = 0; i < 4; i++)
+   {
+      unsigned char *port = &data[1 + 9 * i];
+      if (!(s->plugged & (1 << i)))
+      {
+         memset(port, 0, 9);
+         continue;
+      }
+      // a different button every 64 reports, sticks and triggers sweeping
+      uint16_t btns = 1 << ((t / 64 + i) % 16);
+      port[0] = STATE_NORMAL | 0x04;
+      port[1] = btns >> 8;
+      port[2] = btns & 0xff;
+      port[3] = triangle(t + 128 * i);
+      port[4] = triangle(t * 2 + 128 * i);
+      port[5] = triangle(t / 2);
+      port[6] = triangle(t / 3);
+      port[7] = triangle(t / 4);
+      port[8] = triangle(t / 5);
+   }
+}
+
+static struct adapter *create_synthetic_adapter(void)
+{
+   struct adapter *a = create_adapter(&synthetic_transport);
+   a->synthetic = calloc(1, sizeof(struct synthetic));
+   if (a->synthetic == NULL)
+   {
+      fprintf(stderr, "FATAL: calloc() failed\n");
+      exit(-1);
+   }
+   a->synthetic->plugged = 0x0f;
+   a->synthetic->tick = synthetic_random() & 0xffff;
+   snprintf(a->name, sizeof(a->name), "synthetic%d", synthetic_next_id++);
+   return a;
+}
+
+static void add_synthetic_adapter(void)
+{
+   start_adapter(create_synthetic_adapter());
+}
+
+// randomly plug/unplug a controller or take a whole adapter away and back
+static void synthetic_churn_event(void)
+{
+   int live = 0;
+   for (int n = 0; n < adapter_count; n++)
+   {
+      if (adapter_list[n]->transport == &synthetic_transport)
+         live++;
+   }
+
+   if (live < synthetic_count && (live == 0 || synthetic_random() % 2 == 0))
+   {
+      add_synthetic_adapter();
+      return;
+   }
+
+   int pick = synthetic_random() % live;
+   for (int n = 0; n < adapter_count; n++)
+   {
+      struct adapter *a = adapter_list[n];
+      if (a->transport != &synthetic_transport || pick-- > 0)
+         continue;
+      if (synthetic_random() % 4 == 0)
+      {
+         remove_adapter(a);
+      }
+      else
+      {
+         int port = synthetic_random() % 4;
+         a->synthetic->plugged ^= 1 << port;
+         if (verbose)
+            fprintf(stderr, "adapter %s port %d %s\n", a->name, port,
+                  a->synthetic->plugged & (1 << port) ? "plugged" : "unplugged");
+      }
+      return;
+   }
+}
+
+// rumble writes finish once the adapter sends its next report
+static void synthetic_complete_rumble(struct adapter *a)
+{
+   struct synthetic *s = a->synthetic;
+   pthread_mutex_lock(&a->rumble_lock);
+   bool rumble_completed = s->rumble_pending;
+   s->rumble_pending = false;
+   pthread_mutex_unlock(&a->rumble_lock);
+   if (rumble_completed)
+      rumble_done(a, TRANSFER_OK);
+}
+
+// send every synthetic adapter's reports for this many report periods
+static void synthetic_step(uint64_t expirations)
+{
+   for (int n = 0; n < adapter_count; n++)
+   {
+      struct adapter *a = adapter_list[n];
+      if (a->transport != &synthetic_transport)
+         continue;
+      struct synthetic *s = a->synthetic;
+      synthetic_complete_rumble(a);
+
+      for (uint64_t i = 0; i < expirations && s->running && !a->quitting; i++)
+      {
+         if (synthetic_faults > 0 && synthetic_random() % 1000 < (uint32_t)synthetic_faults)
+         {
+            // a transfer error or a rumble write that won't submit, which
+            // take a few recovery attempts to clear
+            s->failing_attempts = synthetic_random() % 3;
+            if (synthetic_random() % 4 != 0)
+            {
+               adapter_error(a, synthetic_random() % ERROR_KINDS);
+               break;
+            }
+            pthread_mutex_lock(&a->rumble_lock);
+            s->failing_write = true;
+            pthread_mutex_unlock(&a->rumble_lock);
+         }
+         unsigned char data[REPORT_SIZE];
+         synthetic_report(s, data);
+         s->tick++;
+         adapter_report(a, data, REPORT_SIZE);
+      }
+   }
+
+   if (synthetic_churn > 0)
+   {
+      int64_t now = now_ns();
+      if (synthetic_next_churn != 0 && now >= synthetic_next_churn)
+         synthetic_churn_event();
+      if (synthetic_next_churn == 0 || now >= synthetic_next_churn)
+         synthetic_next_churn = now + synthetic_churn * NSEC_PER_SEC / 2
+            + (int64_t)(synthetic_random() % 1000) * synthetic_churn * NSEC_PER_MSEC;
+   }
+}
+
+static void synthetic_timer_handler(struct watch *w, uint32_t events)
+{
+   (void)events;
+   uint64_t expirations = 0;
+   if (read(w->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+      perror("timerfd read");
+   // after a stall, catch up by at most one report queue worth
+   if (expirations > REPORT_QUEUE_SIZE)
+      expirations = REPORT_QUEUE_SIZE;
+   synthetic_step(expirations);
+}
+
+static bool load_synthetic_reports(const char *path)
+{
+   FILE *f = fopen(path, "rb");
+   if (f == NULL)
+   {
+      perror(path);
+      return false;
+   }
+
+   size_t capacity = 0;
+   for (;;)
+   {
+      if (synthetic_report_count == capacity)
+      {
+         capacity = capacity ? capacity * 2 : 1024;
+         unsigned char *grown = realloc(synthetic_reports, capacity * REPORT_SIZE);
+         if (grown == NULL)
+         {
+            fprintf(stderr, "FATAL: realloc() failed\n");
+            exit(-1);
+         }
+         synthetic_reports = grown;
+      }
+      unsigned char *r = &synthetic_reports[synthetic_report_count * REPORT_SIZE];
+      if (fread(r, REPORT_SIZE, 1, f) != 1)
+         break;
+      if (r[0] != 0x21)
+      {
+         fprintf(stderr, "%s: report %zu has type %#04x, not 0x21\n", path, synthetic_report_count, r[0]);
+         fclose(f);
+         return false;
+      }
+      synthetic_report_count++;
+   }
+   fclose(f);
+
+   if (synthetic_report_count == 0)
+   {
+      fprintf(stderr, "%s: no %d byte reports found\n", path, REPORT_SIZE);
+      return false;
+   }
+   fprintf(stderr, "replaying %zu reports from %s\n", synthetic_report_count, path);
+   return true;
+}
+
+static bool synthetic_init(void)
+{
+   if (synthetic_path != NULL && !load_synthetic_reports(synthetic_path))
+      return false;
+
+   synthetic_watch.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+   if (synthetic_watch.fd < 0)
+   {
+      perror("timerfd_create");
+      return false;
+   }
+   struct itimerspec its;
+   its.it_interval = ns_to_timespec(NSEC_PER_SEC / synthetic_rate);
+   its.it_value = its.it_interval;
+   timerfd_settime(synthetic_watch.fd, 0, &its, NULL);
+   synthetic_watch.handler = synthetic_timer_handler;
+   watch_add(&synthetic_watch, EPOLLIN);
+
+   fprintf(stderr, "%d synthetic adapters at %d Hz\n", synthetic_count, synthetic_rate);
+   for (int i = 0; i < synthetic_count; i++)
+      add_synthetic_adapter();
+   return true;
+}
+
+static void synthetic_exit(void)
+{
+   watch_remove(&synthetic_watch);
+   close(synthetic_watch.fd);
+   free(synthetic_reports);
+}
+
+// per replay adapter position: the record and which of its repeats is next
+struct replay_cursor
+{
+   struct adapter *adapter;
+   size_t index;
+   unsigned repeat;
+};
+
+static struct replay_cursor replay_cursors[256];
+static int64_t replay_offset;
+static uint64_t replay_reports;
+static int64_t replay_start;
+
+static void replay_seek(struct replay_cursor *c, uint8_t id, size_t index)
+{
+   for (; index < replay_record_count; index++)
+   {
+      const struct capture_record *r = &replay_records[index];
+      if (r->adapter == id && r->kind == CAPTURE_REPORT)
+         break;
+   }
+   c->index = index;
+   c->repeat = 0;
+}
+
+static int64_t replay_time(const struct replay_cursor *c)
+{
+   const struct capture_record *r = &replay_records[c->index];
+   if (r->repeats == 0)
+      return r->time;
+   // spread the collapsed repeats evenly over the run
+   return r->time + (int64_t)r->span * c->repeat / r->repeats;
+}
+
+// the cursor due next, NULL once every adapter ran out of reports
+static struct replay_cursor *replay_next(void)
+{
+   struct replay_cursor *next = NULL;
+   for (int i = 0; i < 256; i++)
+   {
+      struct replay_cursor *c = &replay_cursors[i];
+      if (c->adapter == NULL || c->index >= replay_record_count)
+         continue;
+      if (next == NULL || replay_time(c) < replay_time(next))
+         next = c;
+   }
+   return next;
+}
+
+static void replay_timer_handler(struct watch *w, uint32_t events)
+{
+   (void)events;
+   uint64_t expirations;
+   if (read(w->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+      perror("timerfd read");
+
+   int64_t now = now_ns();
+   struct replay_cursor *c;
+   for (int fed = 0; (c = replay_next()) != NULL; fed++)
+   {
+      if (replay_fast ? fed >= REPLAY_BATCH : replay_time(c) + replay_offset > now)
+         break;
+
+      struct adapter *a = c->adapter;
+      const struct capture_record *r = &replay_records[c->index];
+      synthetic_complete_rumble(a);
+      if (a->synthetic->running && !a->quitting)
+      {
+         adapter_report(a, r->data, r->size);
+         replay_reports++;
+      }
+
+      if (++c->repeat > r->repeats)
+         replay_seek(c, r->adapter, c->index + 1);
+   }
+
+   if (c == NULL)
+   {
+      double seconds = (now_ns() - replay_start) / (double)NSEC_PER_SEC;
+      fprintf(stderr, "replayed %llu reports in %.3f s (%.0f reports/s)\n",
+            (unsigned long long)replay_reports, seconds, replay_reports / seconds);
+      quitting = 1;
+      return;
+   }
+
+   struct itimerspec its;
+   memset(&its, 0, sizeof(its));
+   if (replay_fast)
+   {
+      // let the rest of the loop run between batches
+      its.it_value.tv_nsec = 1;
+      timerfd_settime(w->fd, 0, &its, NULL);
+   }
+   else
+   {
+      its.it_value = ns_to_timespec(replay_time(c) + replay_offset);
+      timerfd_settime(w->fd, TFD_TIMER_ABSTIME, &its, NULL);
+   }
+}
+
+static bool replay_init(const char *path)
+{
+   int fd = open(path, O_RDONLY);
+   struct stat st;
+   if (fd < 0 || fstat(fd, &st) != 0)
+   {
+      perror(path);
+      if (fd >= 0)
+         close(fd);
+      return false;
+   }
+
+   const struct capture_header *header = NULL;
+   if ((size_t)st.st_size >= sizeof(*header))
+   {
+      replay_map_size = st.st_size;
+      header = mmap(NULL, replay_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (header == MAP_FAILED)
+      {
+         perror("mmap");
+         header = NULL;
+      }
+   }
+   close(fd);
+   if (header == NULL || memcmp(header->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0
+         || header->version != CAPTURE_VERSION || header->record_size != sizeof(struct capture_record))
+   {
+      fprintf(stderr, "%s is not a capture file\n", path);
+      if (header != NULL)
+         munmap((void *)header, replay_map_size);
+      return false;
+   }
+   posix_madvise((void *)header, replay_map_size, POSIX_MADV_SEQUENTIAL);
+   replay_records = (const struct capture_record *)(header + 1);
+   replay_record_count = (replay_map_size - sizeof(*header)) / sizeof(struct capture_record);
+
+   // one synthetic adapter per adapter in the capture, fed from here
+   int count = 0;
+   for (size_t i = 0; i < replay_record_count; i++)
+   {
+      const struct capture_record *r = &replay_records[i];
+      struct replay_cursor *c = &replay_cursors[r->adapter];
+      if (r->kind != CAPTURE_REPORT || c->adapter != NULL)
+         continue;
+      c->adapter = create_synthetic_adapter();
+      snprintf(c->adapter->name, sizeof(c->adapter->name), "replay%d", r->adapter);
+      start_adapter(c->adapter);
+      replay_seek(c, r->adapter, i);
+      count++;
+   }
+   if (count == 0)
+   {
+      fprintf(stderr, "%s has no reports\n", path);
+      return false;
+   }
+   fprintf(stderr, "replaying %zu records for %d adapters from %s%s\n",
+         replay_record_count, count, path, replay_fast ? " as fast as possible" : "");
+
+   replay_watch.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+   if (replay_watch.fd < 0)
+   {
+      perror("timerfd_create");
+      return false;
+   }
+   replay_watch.handler = replay_timer_handler;
+   watch_add(&replay_watch, EPOLLIN);
+
+   replay_start = now_ns();
+   replay_offset = replay_start - replay_time(replay_next());
+   struct itimerspec its;
+   memset(&its, 0, sizeof(its));
+   its.it_value.tv_nsec = 1;
+   timerfd_settime(replay_watch.fd, 0, &its, NULL);
+   return true;
+}
+
+static void replay_exit(void)
+{
+   if (replay_watch.handler != NULL)
+   {
+      watch_remove(&replay_watch);
+      close(replay_watch.fd);
+   }
+   if (replay_records != NULL)
+      munmap((void *)((const struct capture_header *)replay_records - 1), replay_map_size);
+}
+
+static void reap_adapters(void)
+{
+   // without I/O threads nobody else tears down the virtual devices of
+   // adapters that stopped on an error
+   if (single_thread)
+   {
+      for (int n = 0; n < adapter_count; n++)
+      {
+         struct adapter *a = adapter_list[n];
+         if (a->quitting && !a->parking)
+            destroy_ports(a);
+      }
+   }
+
+   service_recovery();
+
+   struct adapter **p = &dying_adapters;
+   while (*p != NULL)
+   {
+      struct adapter *a = *p;
+      // a recovery job still holds it
+      if (!adapter_idle(a) || a->recovery == RECOVERY_BUSY)
+      {
+         p = &a->next;
+         continue;
+      }
+
+      // its watches go now, the rest is torn down on the hotplug worker so
+      // waiting for the I/O thread doesn't hold up the other adapters
+      if (a->ff_timer >= 0)
+      {
+         watch_remove(&a->ff_timer_watch);
+         close(a->ff_timer);
+         a->ff_timer = -1;
+      }
+      for (int i = 0; i < 4 && single_thread; i++)
+      {
+         if (a->controllers[i].connected)
+            watch_remove(&a->controllers[i].ff_watch);
+      }
+      fprintf(stderr, "adapter %s disconnected\n", a->name);
+      // in one go, so a replug's finished open always finds it in one of
+      // the two and waits for it
+      pthread_mutex_lock(&hotplug_lock);
+      *p = a->next;
+      queue_hotplug_job(a, JOB_CLOSE);
+      pthread_mutex_unlock(&hotplug_lock);
+   }
+}
+
+static void usb_watch_handler(struct watch *w, uint32_t events)
+{
+   (void)w;
+   (void)events;
+   usb_events_ready = true;
+}
+
+// also called on the hotplug worker when it opens or closes a device, so
+// nothing is allocated per fd
+static void LIBUSB_CALL usb_pollfd_added(int fd, short events, void *user_data)
+{
+   (void)user_data;
+   struct epoll_event ev = { 0 };
+   // poll and epoll share bit values for POLLIN/POLLOUT
+   ev.events = (uint32_t)events;
+   ev.data.ptr = &usb_watch;
+   if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+      perror("epoll_ctl");
+}
+
+static void LIBUSB_CALL usb_pollfd_removed(int fd, void *user_data)
+{
+   (void)user_data;
+   epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+static bool event_loop_init(void)
+{
+   epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+   if (epoll_fd < 0)
+   {
+      perror("epoll_create1");
+      return false;
+   }
+
+   usb_watch.handler = usb_watch_handler;
+   libusb_set_pollfd_notifiers(NULL, usb_pollfd_added, usb_pollfd_removed, NULL);
+   const struct libusb_pollfd **pollfds = libusb_get_pollfds(NULL);
+   if (pollfds == NULL)
+   {
+      fprintf(stderr, "libusb_get_pollfds failed\n");
+      return false;
+   }
+   for (int i = 0; pollfds[i] != NULL; i++)
+      usb_pollfd_added(pollfds[i]->fd, pollfds[i]->events, NULL);
+   libusb_free_pollfds(pollfds);
+   return true;
+}
+
+// wait for activity on libusb's fds (and every uinput fd in single-thread
+// mode) and dispatch it, for at most timeout_ms milliseconds
+static void event_loop_run(int timeout_ms)
+{
+   struct timeval tv;
+   if (libusb_get_next_timeout(NULL, &tv) == 1)
+   {
+      int usb_timeout = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+      if (timeout_ms < 0 || usb_timeout < timeout_ms)
+         timeout_ms = usb_timeout;
+   }
+
+   struct epoll_event events[32];
+   int count = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout_ms);
+   if (count < 0 && errno != EINTR)
+      perror("epoll_wait");
+
+   for (int i = 0; i < count; i++)
+   {
+      struct watch *w = (struct watch *)events[i].data.ptr;
+      w->handler(w, events[i].events);
+   }
+
+   // libusb timeouts are serviced here too when they can't be waited on
+   if (usb_events_ready || count == 0)
+   {
+      struct timeval zero = { 0, 0 };
+      usb_events_ready = false;
+      libusb_handle_events_timeout_completed(NULL, &zero, NULL);
+   }
+}
+
+static void dump_stats(void)
+{
+   // CPU time of the whole process per report, which should stay flat as
+   // adapters are added
+   static int64_t last_cpu;
+   struct timespec ts;
+   clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+   int64_t cpu = ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+   uint64_t total_reports = 0;
+
+   for (int n = 0; n < adapter_count; n++)
+   {
+      struct adapter *a = adapter_list[n];
+      unsigned dropped = __atomic_exchange_n(&a->proc_samples.dropped, 0, __ATOMIC_RELAXED);
+      dropped += __atomic_exchange_n(&a->usb_samples.dropped, 0, __ATOMIC_RELAXED);
+      uint64_t syscalls = __atomic_exchange_n(&a->syscalls, 0, __ATOMIC_RELAXED);
+      uint64_t reports = __atomic_load_n(&a->reports, __ATOMIC_RELAXED);
+      reports -= a->reports_dumped;
+      a->reports_dumped += reports;
+      total_reports += reports;
+      uint64_t frames = 0, suppressed = 0;
+      for (int i = 0; i < 4; i++)
+      {
+         struct ports *port = &a->controllers[i];
+         uint64_t total = __atomic_load_n(&port->frames, __ATOMIC_RELAXED);
+         frames += total - port->frames_dumped;
+         port->frames_dumped = total;
+         total = __atomic_load_n(&port->frames_suppressed, __ATOMIC_RELAXED);
+         suppressed += total - port->suppressed_dumped;
+         port->suppressed_dumped = total;
+      }
+      fprintf(stderr, "adapter %s stats (%u samples dropped, %.2f syscalls/report, %llu frames, %llu suppressed by %s):\n",
+            a->name, dropped, reports > 0 ? (double)syscalls / reports : 0.0,
+            (unsigned long long)frames, (unsigned long long)suppressed, EMIT_MODE_NAMES[emit_mode]);
+      for (int m = 0; m < METRIC_COUNT; m++)
+      {
+         struct histogram *h = &a->histograms[m];
+         fprintf(stderr, "  %-10s count=%llu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+               METRIC_NAMES[m], (unsigned long long)h->count,
+               hist_percentile(h, 50.0) / 1000.0, hist_percentile(h, 99.0) / 1000.0,
+               hist_percentile(h, 99.9) / 1000.0, h->max / 1000.0);
+         memset(h, 0, sizeof(*h));
+      }
+
+      uint64_t errors = 0;
+      for (int k = 0; k < ERROR_KINDS; k++)
+         errors += a->errors[k];
+      if (errors > 0)
+      {
+         fprintf(stderr, "  errors     timeout=%llu stall=%llu overflow=%llu io=%llu submit=%llu, %u recoveries, longest %.1fms\n",
+               (unsigned long long)a->errors[ERROR_TIMEOUT], (unsigned long long)a->errors[ERROR_STALL],
+               (unsigned long long)a->errors[ERROR_OVERFLOW], (unsigned long long)a->errors[ERROR_IO],
+               (unsigned long long)a->errors[ERROR_SUBMIT], a->recoveries, a->recovery_max / (double)NSEC_PER_MSEC);
+      }
+   }
+
+   fprintf(stderr, "%d adapters on %d I/O threads, %llu reports, %.2fus CPU/report\n",
+         adapter_count, io_thread_count, (unsigned long long)total_reports,
+         total_reports > 0 ? (cpu - last_cpu) / 1000.0 / total_reports : 0.0);
+   last_cpu = cpu;
+}
+
+static void stats_timer_handler(struct watch *w, uint32_t events)
+{
+   (void)events;
+   static int64_t next_dump;
+   uint64_t expirations;
+   if (read(w->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+      perror("timerfd read");
+
+   for (int n = 0; n < adapter_count; n++)
+   {
+      struct adapter *a = adapter_list[n];
+      drain_samples(&a->proc_samples, a->histograms);
+      drain_samples(&a->usb_samples, a->histograms);
+   }
+
+   int64_t now = now_ns();
+   if (stats_interval > 0 && next_dump == 0)
+      next_dump = now + stats_interval * NSEC_PER_SEC;
+   if (stats_requested || (stats_interval > 0 && now >= next_dump))
+   {
+      stats_requested = 0;
+      if (stats_interval > 0)
+         next_dump = now + stats_interval * NSEC_PER_SEC;
+      dump_stats();
+   }
+}
+
+static bool stats_init(struct watch *w)
+{
+   w->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+   if (w->fd < 0)
+   {
+      perror("timerfd_create");
+      return false;
+   }
+   struct itimerspec its;
+   its.it_interval = ns_to_timespec(STATS_DRAIN_MSEC * NSEC_PER_MSEC);
+   its.it_value = its.it_interval;
+   timerfd_settime(w->fd, 0, &its, NULL);
+   w->handler = stats_timer_handler;
+   watch_add(w, EPOLLIN);
+   return true;
+}
+
+static void control_close(struct control_client *c)
+{
+   watch_remove(&c->watch);
+   close(c->watch.fd);
+   c->watch.fd = -1;
+   free(c->out);
+   c->out = NULL;
+   c->out_len = 0;
+   c->out_sent = 0;
+   c->in_len = 0;
+}
+
+// write what the client will take and wait for room for the rest
+static bool control_flush(struct control_client *c)
+{
+   while (c->out_sent < c->out_len)
+   {
+      ssize_t ret = send(c->watch.fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+      if (ret < 0 && errno == EINTR)
+         continue;
+      if (ret < 0 && errno == EAGAIN)
+         break;
+      if (ret < 0)
+         return false;
+      c->out_sent += ret;
+   }
+
+   bool waiting = c->out_sent < c->out_len;
+   if (!waiting)
+   {
+      c->out_len = 0;
+      c->out_sent = 0;
+   }
+   if (waiting != c->waiting)
+   {
+      struct epoll_event ev = { 0 };
+      ev.events = waiting ? EPOLLIN | EPOLLOUT : EPOLLIN;
+      ev.data.ptr = &c->watch;
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->watch.fd, &ev);
+      c->waiting = waiting;
+   }
+   return true;
+}
+
+// counters of every adapter as one line of JSON; they're only ever loaded,
+// so a query never holds up the threads writing them
+static void control_stats(FILE *f)
+{
+   fprintf(f, "{\"uptime_ms\":%lld,\"raw\":%s,\"rumble\":%s,\"emit\":\"%s\",\"io_threads\":%d,\"adapters\":[",
+         (long long)((now_ns() - startup_time) / NSEC_PER_MSEC), raw_mode ? "true" : "false",
+         rumble_enabled ? "true" : "false", EMIT_MODE_NAMES[emit_mode], io_thread_count);
+   for (int n = 0; n < adapter_count; n++)
+   {
+      struct adapter *a = adapter_list[n];
+      fprintf(f, "%s{\"name\":\"%s\",\"transport\":\"%s\",\"slot\":%d,\"reports\":%llu,\"reports_invalid\":%llu,"
+            "\"reports_overrun\":%u,\"rumble_packets\":%llu,\"errors\":{",
+            n > 0 ? "," : "", a->name, a->transport->name, a->slot,
+            (unsigned long long)__atomic_load_n(&a->reports, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&a->reports_invalid, __ATOMIC_RELAXED),
+            __atomic_load_n(&a->queue_dropped, __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&a->rumble_packets, __ATOMIC_RELAXED));
+      for (int k = 0; k < ERROR_KINDS; k++)
+         fprintf(f, "%s\"%s\":%llu", k > 0 ? "," : "", ERROR_NAMES[k], (unsigned long long)a->errors[k]);
+      fprintf(f, "},\"recoveries\":%u,\"ports\":[", a->recoveries);
+      for (int i = 0; i < 4; i++)
+      {
+         struct ports *port = &a->controllers[i];
+         unsigned char type = __atomic_load_n(&port->type, __ATOMIC_RELAXED);
+         bool connected = __atomic_load_n(&port->connected, __ATOMIC_RELAXED) &&
+            !__atomic_load_n(&port->detached, __ATOMIC_RELAXED);
+         fprintf(f, "%s{\"port\":%d,\"controller\":\"%s\",\"events\":%llu,\"frames\":%llu,\"frames_suppressed\":%llu,\"write_errors\":%llu,"
+               "\"ff_upload_wait_max_us\":%ld}",
+               i > 0 ? "," : "", a->slot * 4 + i + 1,
+               !connected ? "none" : type == STATE_WAVEBIRD ? "wavebird" : "normal",
+               (unsigned long long)__atomic_load_n(&port->events, __ATOMIC_RELAXED),
+               (unsigned long long)__atomic_load_n(&port->frames, __ATOMIC_RELAXED),
+               (unsigned long long)__atomic_load_n(&port->frames_suppressed, __ATOMIC_RELAXED),
+               (unsigned long long)__atomic_load_n(&port->write_errors, __ATOMIC_RELAXED),
+               __atomic_load_n(&port->ff_upload_wait_max, __ATOMIC_RELAXED));
+      }
+      fprintf(f, "]}");
+   }
+   fprintf(f, "]}\n");
+}
+
+static bool parse_switch(const char *str, bool *value)
+{
+   if (str != NULL && strcmp(str, "on") == 0)
+      *value = true;
+   else if (str != NULL && strcmp(str, "off") == 0)
+      *value = false;
+   else
+      return false;
+   return true;
+}
+
+// one command line, answered with one line of JSON
+static void control_command(char *line, FILE *f)
+{
+   char *save = NULL;
+   char *command = strtok_r(line, " \t\r", &save);
+   char *arg = command != NULL ? strtok_r(NULL, " \t\r", &save) : NULL;
+   bool value;
+
+   if (command == NULL)
+      fprintf(f, "{\"error\":\"empty command\"}\n");
+   else if (strcmp(command, "stats") == 0)
+      control_stats(f);
+   else if (strcmp(command, "raw") == 0 && parse_switch(arg, &value))
+   {
+      if (value != raw_mode)
+         fprintf(stderr, "raw mode %s\n", value ? "enabled" : "disabled");
+      set_raw_mode(value);
+      fprintf(f, "{\"raw\":%s}\n", value ? "true" : "false");
+   }
+   else if (strcmp(command, "rumble") == 0 && parse_switch(arg, &value))
+   {
+      if (value != rumble_enabled)
+         fprintf(stderr, "rumble %s\n", value ? "enabled" : "disabled");
+      __atomic_store_n(&rumble_enabled, value, __ATOMIC_RELAXED);
+      fprintf(f, "{\"rumble\":%s}\n", value ? "true" : "false");
+   }
+   else
+      fprintf(f, "{\"error\":\"unknown command, try stats, raw on|off or rumble on|off\"}\n");
+}
+
+static void control_client_handler(struct watch *w, uint32_t events)
+{
+   struct control_client *c = (struct control_client *)w->data;
+
+   if (events & EPOLLIN)
+   {
+      ssize_t ret = recv(w->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+      if (ret <= 0)
+      {
+         if (ret == 0 || (errno != EINTR && errno != EAGAIN))
+            control_close(c);
+         return;
+      }
+      c->in_len += ret;
+
+      char *buf;
+      size_t len;
+      FILE *f = open_memstream(&buf, &len);
+      if (f == NULL)
+      {
+         perror("open_memstream");
+         control_close(c);
+         return;
+      }
+      size_t start = 0;
+      for (size_t end = 0; end < c->in_len; end++)
+      {
+         if (c->in[end] != '\n')
+            continue;
+         c->in[end] = '\0';
+         control_command(c->in + start, f);
+         start = end + 1;
+      }
+      memmove(c->in, c->in + start, c->in_len - start);
+      c->in_len -= start;
+      fclose(f);
+
+      // a client that doesn't send lines or doesn't read its answers gets
+      // dropped instead of growing the buffers
+      if (c->in_len == sizeof(c->in) || c->out_len - c->out_sent + len > CONTROL_OUTPUT_MAX)
+      {
+         free(buf);
+         control_close(c);
+         return;
+      }
+      if (len > 0)
+      {
+         char *out = realloc(c->out, c->out_len + len);
+         if (out == NULL)
+         {
+            fprintf(stderr, "FATAL: realloc() failed\n");
+            exit(-1);
+         }
+         memcpy(out + c->out_len, buf, len);
+         c->out = out;
+         c->out_len += len;
+      }
+      free(buf);
+   }
+   else if (!(events & EPOLLOUT))
    {
-      ret.tv_sec++;
-      ret.tv_nsec -= 1000000000L;
+      // hung up or errored without anything left to read
+      control_close(c);
+      return;
    }
-   return ret;
+
+   if (!control_flush(c))
+      control_close(c);
 }
 
-static bool ts_greaterthan(struct timespec *first, struct timespec *second)
+static void control_accept_handler(struct watch *w, uint32_t events)
 {
-   return (first->tv_sec >= second->tv_sec || (first->tv_sec == second->tv_sec && first->tv_nsec >= second->tv_nsec));
+   (void)events;
+   int fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+   if (fd < 0)
+   {
+      if (errno != EAGAIN && errno != EINTR)
+         perror("accept4");
+      return;
+   }
+
+   for (int k = 0; k < MAX_CONTROL_CLIENTS; k++)
+   {
+      struct control_client *c = &control_clients[k];
+      if (c->watch.fd >= 0)
+         continue;
+      c->watch.fd = fd;
+      c->watch.handler = control_client_handler;
+      c->watch.data = c;
+      c->waiting = false;
+      watch_add(&c->watch, EPOLLIN);
+      return;
+   }
+   fprintf(stderr, "too many control connections\n");
+   close(fd);
 }
 
-static bool ts_lessthan(struct timespec *first, struct timespec *second)
+// a Unix socket served from the event loop, see control_command()
+static bool control_init(const char *path)
 {
-   return (first->tv_sec <= second->tv_sec || (first->tv_sec == second->tv_sec && first->tv_nsec <= second->tv_nsec));
+   struct sockaddr_un addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if (strlen(path) >= sizeof(addr.sun_path))
+   {
+      fprintf(stderr, "control socket path %s is too long\n", path);
+      return false;
+   }
+   strcpy(addr.sun_path, path);
+
+   for (int k = 0; k < MAX_CONTROL_CLIENTS; k++)
+      control_clients[k].watch.fd = -1;
+
+   control_watch.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (control_watch.fd < 0)
+   {
+      perror("socket");
+      return false;
+   }
+   // left behind by a daemon that didn't exit cleanly, unless one still
+   // answers on it
+   struct stat st;
+   if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+   {
+      int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      bool stale = probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) != 0
+         && (errno == ECONNREFUSED || errno == ENOENT);
+      if (probe >= 0)
+         close(probe);
+      if (!stale)
+      {
+         fprintf(stderr, "control socket %s is in use by another daemon\n", path);
+         close(control_watch.fd);
+         control_watch.fd = -1;
+         return false;
+      }
+      unlink(path);
+   }
+   // it switches raw mode and rumble, so only for our user; nobody can
+   // connect before listen(), so chmod() after bind() leaves no window
+   if (bind(control_watch.fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+         chmod(path, 0600) != 0 ||
+         listen(control_watch.fd, MAX_CONTROL_CLIENTS) != 0)
+   {
+      perror(path);
+      close(control_watch.fd);
+      control_watch.fd = -1;
+      return false;
+   }
+   control_watch.handler = control_accept_handler;
+   watch_add(&control_watch, EPOLLIN);
+   fprintf(stderr, "control socket at %s\n", path);
+   return true;
 }
 
-static void update_ff_start_stop(struct ff_event *e, struct timespec *current_time)
+static void control_exit(void)
 {
-   e->repetitions--;
+   for (int k = 0; k < MAX_CONTROL_CLIENTS; k++)
+   {
+      if (control_clients[k].watch.fd >= 0)
+         control_close(&control_clients[k]);
+   }
+   watch_remove(&control_watch);
+   close(control_watch.fd);
+   unlink(control_path);
+}
 
-   if (e->repetitions < 0)
+static bool shm_init(const char *name)
+{
+   // POSIX shared memory names are a single leading slash and no others
+   snprintf(shm_name, sizeof(shm_name), "%s%s", name[0] == '/' ? "" : "/", name);
+   int fd = shm_open(shm_name, O_CREAT | O_RDWR, 0644);
+   if (fd < 0)
+   {
+      perror(shm_name);
+      return false;
+   }
+   if (ftruncate(fd, sizeof(struct gc_shm)) != 0)
    {
-      e->repetitions = 0;
-      e->start_time.tv_sec = 0;
-      e->start_time.tv_nsec = 0;
-      e->end_time.tv_sec = 0;
-      e->end_time.tv_nsec = 0;
+      perror("ftruncate");
+      close(fd);
+      return false;
    }
-   else
+   void *map = mmap(NULL, sizeof(struct gc_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED)
+   {
+      perror("mmap");
+      return false;
+   }
+
+   shm = (struct gc_shm *)map;
+   memset(shm, 0, sizeof(*shm));
+   shm->header.version = GC_SHM_VERSION;
+   shm->header.port_count = GC_SHM_PORTS;
+   shm->header.port_size = sizeof(struct gc_shm_port);
+   // readers check the magic last
+   __atomic_store_n(&shm->header.magic, GC_SHM_MAGIC, __ATOMIC_RELEASE);
+   fprintf(stderr, "publishing controller state in %s\n", shm_name);
+   return true;
+}
+
+static void shm_exit(void)
+{
+   munmap(shm, sizeof(struct gc_shm));
+   shm_unlink(shm_name);
+   shm = NULL;
+}
+
+// read+write syscalls made by this process so far, -1 if unknown
+static int64_t count_syscalls(void)
+{
+   FILE *f = fopen("/proc/self/io", "r");
+   if (f == NULL)
+      return -1;
+   char line[64];
+   int64_t total = 0;
+   int found = 0;
+   while (fgets(line, sizeof(line), f) != NULL)
    {
-      e->start_time = ts_add(current_time, e->delay);
-      if (e->forever)
+      long long value;
+      if (sscanf(line, "syscr: %lld", &value) == 1 || sscanf(line, "syscw: %lld", &value) == 1)
       {
-         e->end_time.tv_sec = INT_MAX;
-         e->end_time.tv_nsec = 999999999L;
+         total += value;
+         found++;
       }
-      else
+   }
+   fclose(f);
+   return found == 2 ? total : -1;
+}
+
+// CPU time the I/O threads have used so far, -1 if unknown
+static int64_t bench_io_cpu_ns(void)
+{
+   int64_t total = 0;
+   for (int k = 0; k < io_thread_count; k++)
+   {
+      clockid_t clock;
+      struct timespec ts;
+      if (pthread_getcpuclockid(io_threads[k].thread, &clock) != 0 || clock_gettime(clock, &ts) < 0)
+         return -1;
+      total += ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+   }
+   return total;
+}
+
+// empty bench_pool()'s stand-in sinks before they fill up
+static void bench_drain(int sinks[][4], int count)
+{
+   char buf[4096];
+   for (int n = 0; n < count; n++)
+   {
+      for (int i = 0; i < 4; i++)
       {
-         e->end_time = ts_add(&e->start_time, e->duration);
+         while (read(sinks[n][i], buf, sizeof(buf)) > 0)
+            ;
       }
    }
 }
 
-static int create_ff_event(struct ports *port, struct uinput_ff_upload *upload)
+// one JSON object per line on stdout, so runs can be diffed and tracked
+static void bench_result(const char *name, uint64_t ops, int64_t ns, const char *extra)
 {
-   bool stop = false;
-   switch (upload->effect.type)
+   double ns_per_op = (double)ns / ops;
+   printf("{\"bench\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f%s}\n",
+         name, (unsigned long long)ops, ns_per_op, 1e9 / ns_per_op, extra);
+   fflush(stdout);
+}
+
+static void bench_reports(unsigned char reports[BENCH_REPORTS][REPORT_SIZE])
+{
+   struct synthetic s;
+   memset(&s, 0, sizeof(s));
+   s.plugged = 0x0f;
+   for (int k = 0; k < BENCH_REPORTS; k++)
    {
-      case FF_PERIODIC:
-         stop = upload->effect.u.periodic.magnitude == 0;
-         break;
-      case FF_RUMBLE:
-         stop = upload->effect.u.rumble.strong_magnitude == 0 && upload->effect.u.rumble.weak_magnitude == 0;
-         break;
+      // skip ahead so every report moves the sticks and some buttons
+      s.tick = k * 7;
+      synthetic_report(&s, reports[k]);
    }
-   if (upload->old.type != 0)
+}
+
+static void bench_diff(const char *name, unsigned (*diff)(const unsigned char *, const unsigned char *),
+      unsigned char reports[BENCH_REPORTS][REPORT_SIZE])
+{
+   uint64_t ops = 0;
+   unsigned acc = 0;
+   int64_t start = now_ns(), end;
+   do
+   {
+      for (int k = 0; k < BENCH_REPORTS; k++)
+         acc += diff(reports[k], reports[(k + 1) % BENCH_REPORTS]);
+      ops += BENCH_REPORTS;
+      end = now_ns();
+   } while (end - start < BENCH_MSEC * NSEC_PER_MSEC);
+   bench_sink += acc;
+   bench_result(name, ops, end - start, "");
+}
+
+// report_diff() against the scalar version for random report pairs and
+// for every single byte change of a random report, where a vector lane
+// mixup would show; returns the number of mismatches
+static uint64_t bench_diff_check(void)
+{
+   uint64_t pairs = 0, mismatches = 0;
+   unsigned char prev[REPORT_SIZE], cur[REPORT_SIZE];
+   int64_t start = now_ns();
+   for (int k = 0; k < 4096; k++)
    {
-      if (stop)
+      for (int j = 0; j < REPORT_SIZE; j++)
       {
-         port->ff_events[upload->old.id].forever = false;
-         port->ff_events[upload->old.id].duration = 0;
+         prev[j] = synthetic_random();
+         cur[j] = synthetic_random();
       }
-      else
+      // mostly equal ports, so partial differences come up too
+      for (int i = 0; i < 4; i++)
       {
-         // events with length 0 last forever
-         port->ff_events[upload->old.id].forever = (upload->effect.replay.length == 0);
-         port->ff_events[upload->old.id].duration = upload->effect.replay.length;
+         if (synthetic_random() % 2 == 0)
+            memcpy(&cur[1 + i * 9], &prev[1 + i * 9], 9);
+      }
+      for (int j = -1; j < REPORT_SIZE; j++)
+      {
+         if (j >= 0)
+         {
+            memcpy(cur, prev, REPORT_SIZE);
+            cur[j] ^= 1 << (synthetic_random() % 8);
+         }
+         unsigned expected = report_diff_scalar(prev, cur);
+         unsigned got = report_diff(prev, cur);
+         pairs++;
+         if (got != expected && mismatches++ < 10)
+         {
+            if (j < 0)
+               fprintf(stderr, "report_diff_check: got %x, expected %x for random reports\n", got, expected);
+            else
+               fprintf(stderr, "report_diff_check: got %x, expected %x with byte %d changed\n", got, expected, j);
+         }
       }
-      port->ff_events[upload->old.id].delay = upload->effect.replay.delay;
-      port->ff_events[upload->old.id].repetitions = 0;
-      return upload->old.id;
    }
-   for (int i = 0; i < MAX_FF_EVENTS; i++)
+   int64_t end = now_ns();
+
+   char extra[64];
+   snprintf(extra, sizeof(extra), ",\"mismatches\":%llu", (unsigned long long)mismatches);
+   bench_result("report_diff_check", pairs, end - start, extra);
+   return mismatches;
+}
+
+// the events decoded from a stream of random reports when report_diff()
+// picks the ports to look at, against the same stream picked by the scalar
+// version, in every emission mode; returns the number of mismatches
+static uint64_t bench_event_check(void)
+{
+   enum emit_mode saved_mode = emit_mode;
+   uint64_t reports = 0, events = 0, mismatches = 0;
+   int64_t start = now_ns();
+   for (int mode = EMIT_LATENCY; mode <= EMIT_JITTER; mode++)
    {
-      if (!port->ff_events[i].in_use)
+      emit_mode = mode;
+      struct ports ports[2][4];
+      memset(ports, 0, sizeof(ports));
+      for (int i = 0; i < 4; i++)
       {
-         port->ff_events[i].in_use = true;
-         if (stop)
+         ports[0][i].number = ports[1][i].number = i;
+         ports[0][i].map = ports[1][i].map = port_maps[i];
+      }
+      unsigned char prev[REPORT_SIZE], cur[REPORT_SIZE];
+      memset(prev, 0, sizeof(prev));
+      for (int k = 0; k < 16384; k++)
+      {
+         memcpy(cur, prev, REPORT_SIZE);
+         // a port or two moving, single bit flips, or all new
+         uint32_t r = synthetic_random();
+         if (r % 8 == 0)
+         {
+            for (int j = 1; j < REPORT_SIZE; j++)
+               cur[j] = synthetic_random();
+         }
+         else if (r % 8 < 4)
          {
-            port->ff_events[i].forever = false;
-            port->ff_events[i].duration = 0;
+            cur[1 + (r >> 3) % 36] ^= 1 << (r >> 9) % 8;
          }
          else
          {
-            port->ff_events[i].forever = (upload->effect.replay.length == 0);
-            port->ff_events[i].duration = upload->effect.replay.length;
+            for (int i = 0; i < 4; i++)
+            {
+               if ((r >> (3 + i)) & 1)
+                  for (int j = 1; j < 9; j++)
+                     cur[1 + i * 9 + j] = synthetic_random();
+            }
          }
-         port->ff_events[i].delay = upload->effect.replay.delay;
-         port->ff_events[i].repetitions = 0;
-         return i;
+
+         unsigned changed[2] = { report_diff_scalar(prev, cur), report_diff(prev, cur) };
+         int64_t now = k * NSEC_PER_MSEC;
+         for (int i = 0; i < 4; i++)
+         {
+            struct input_event expected[MAX_PAYLOAD_EVENTS], got[MAX_PAYLOAD_EVENTS];
+            int counts[2] = { 0, 0 };
+            struct input_event *out[2] = { expected, got };
+            for (int v = 0; v < 2; v++)
+            {
+               // held axes are looked at again, as process_report() does
+               if ((changed[v] & (1 << i)) || ports[v][i].held)
+                  counts[v] = decode_payload(&ports[v][i], &cur[1 + i * 9], out[v], now);
+            }
+            events += counts[0];
+            bool same = counts[0] == counts[1];
+            for (int e = 0; same && e < counts[0]; e++)
+            {
+               same = expected[e].type == got[e].type && expected[e].code == got[e].code
+                  && expected[e].value == got[e].value;
+            }
+            if (!same && mismatches++ < 10)
+            {
+               fprintf(stderr, "event_check: port %d of report %d in %s mode decoded %d events, expected %d\n",
+                     i + 1, k, EMIT_MODE_NAMES[mode], counts[1], counts[0]);
+            }
+         }
+         memcpy(prev, cur, REPORT_SIZE);
+         reports++;
       }
    }
+   int64_t end = now_ns();
+   emit_mode = saved_mode;
 
-   return -1;
+   char extra[96];
+   snprintf(extra, sizeof(extra), ",\"events\":%llu,\"mismatches\":%llu",
+         (unsigned long long)events, (unsigned long long)mismatches);
+   bench_result("event_check", reports, end - start, extra);
+   return mismatches;
 }
 
-static void handle_payload(int i, struct ports *port, unsigned char *payload, struct timespec *current_time)
+// one run per emission mode, reports spaced 1ms apart
+static void bench_decode(unsigned char reports[BENCH_REPORTS][REPORT_SIZE])
 {
-   unsigned char status = payload[0];
-   unsigned char type = connected_type(status);
+   enum emit_mode saved_mode = emit_mode;
+   for (int mode = EMIT_LATENCY; mode <= EMIT_JITTER; mode++)
+   {
+      emit_mode = mode;
+      struct ports port;
+      memset(&port, 0, sizeof(port));
+      port.map = port_maps[0];
+      struct input_event events[MAX_PAYLOAD_EVENTS];
+      memset(events, 0, sizeof(events));
 
-   if (type != 0 && !port->connected)
+      uint64_t ops = 0, count = 0;
+      int64_t start = now_ns(), end;
+      do
+      {
+         for (int k = 0; k < BENCH_REPORTS; k++)
+            count += decode_payload(&port, &reports[k][1 + (k & 3) * 9], events, (ops + k) * NSEC_PER_MSEC);
+         ops += BENCH_REPORTS;
+         end = now_ns();
+      } while (end - start < BENCH_MSEC * NSEC_PER_MSEC);
+      bench_sink += count + events[0].code;
+
+      char name[32], extra[96];
+      snprintf(name, sizeof(name), mode == EMIT_LATENCY ? "decode_payload" : "decode_payload_%s", EMIT_MODE_NAMES[mode]);
+      snprintf(extra, sizeof(extra), ",\"events_per_op\":%.2f,\"frames_per_op\":%.2f,\"suppressed_per_op\":%.2f",
+            (double)count / ops, (double)port.frames / ops, (double)port.frames_suppressed / ops);
+      bench_result(name, ops, end - start, extra);
+   }
+   emit_mode = saved_mode;
+}
+
+// a port with a rumble, a sine and a square effect playing
+static void bench_ff_port(struct ports *port, int64_t now)
+{
+   struct uinput_ff_upload upload;
+   memset(&upload, 0, sizeof(upload));
+   upload.effect.type = FF_RUMBLE;
+   upload.effect.u.rumble.strong_magnitude = 0x8000;
+   ff_play(port->adapter, &port->ff_events[create_ff_event(port, &upload)], 1, now);
+
+   memset(&upload, 0, sizeof(upload));
+   upload.effect.type = FF_PERIODIC;
+   upload.effect.u.periodic.waveform = FF_SINE;
+   upload.effect.u.periodic.magnitude = 0x4000;
+   upload.effect.u.periodic.period = 50;
+   upload.effect.u.periodic.envelope.attack_length = 200;
+   upload.effect.u.periodic.envelope.fade_length = 200;
+   upload.effect.replay.length = 10000;
+   ff_play(port->adapter, &port->ff_events[create_ff_event(port, &upload)], 1, now);
+
+   memset(&upload, 0, sizeof(upload));
+   upload.effect.type = FF_PERIODIC;
+   upload.effect.u.periodic.waveform = FF_SQUARE;
+   upload.effect.u.periodic.magnitude = 0x2000;
+   upload.effect.u.periodic.period = 20;
+   ff_play(port->adapter, &port->ff_events[create_ff_event(port, &upload)], 1, now);
+
+   ff_run(port->adapter, now);
+}
+
+static void bench_ff_level(void)
+{
+   struct adapter *a = create_synthetic_adapter();
+   struct ports *port = &a->controllers[0];
+   bench_ff_port(port, 0);
+
+   uint64_t ops = 0;
+   int64_t acc = 0, now = 0;
+   int64_t start = now_ns(), end;
+   do
+   {
+      for (int k = 0; k < 1024; k++)
+      {
+         now += NSEC_PER_MSEC;
+         acc += ff_port_level(port, now);
+      }
+      ops += 1024;
+      end = now_ns();
+   } while (end - start < BENCH_MSEC * NSEC_PER_MSEC);
+   bench_sink += acc;
+   bench_result("ff_port_level", ops, end - start, "");
+   free_adapter(a);
+}
+
+static void bench_rumble(void)
+{
+   int saved_pwm_hz = rumble_pwm_hz;
+   rumble_pwm_hz = 1000;
+
+   struct adapter *a = create_synthetic_adapter();
+   for (int i = 0; i < 4; i++)
    {
-      uinput_create(i, port, type);
+      struct ports *port = &a->controllers[i];
+      port->connected = true;
+      port->extra_power = true;
+      port->type = STATE_NORMAL;
+      bench_ff_port(port, 0);
    }
-   else if (type == 0 && port->connected)
+
+   // one PWM step per call; the write only stays queued behind the first
+   uint64_t ops = 0;
+   int64_t now = 0;
+   int64_t start = now_ns(), end;
+   do
+   {
+      for (int k = 0; k < 1024; k++)
+      {
+         now += NSEC_PER_MSEC;
+         update_rumble(a, now);
+      }
+      ops += 1024;
+      end = now_ns();
+   } while (end - start < BENCH_MSEC * NSEC_PER_MSEC);
+   bench_sink += a->rumble[1];
+   bench_result("update_rumble", ops, end - start, "");
+
+   rumble_pwm_hz = saved_pwm_hz;
+   for (int i = 0; i < 4; i++)
+      a->controllers[i].connected = false;
+   free_adapter(a);
+}
+
+// what the simulation expects of an effect slot, worked out in closed form
+// from the requests instead of stepping a heap like ff_run()
+struct ff_model
+{
+   bool in_use;
+   bool forever;
+   int delay;
+   int duration;
+   // plays left from start on, one every delay + duration; none while 0
+   int repetitions;
+   int64_t start;
+   // the peak drive level while playing, ramped up from and down to 0
+   // over attack and fade milliseconds of each play
+   int32_t level;
+   int attack;
+   int fade;
+};
+
+static int64_t virtual_now;
+
+static int64_t virtual_clock(void)
+{
+   return virtual_now;
+}
+
+static bool ff_model_playing(const struct ff_model *m, int64_t t)
+{
+   if (m->repetitions == 0 || t < m->start)
+      return false;
+   if (m->forever)
+      return true;
+   int64_t period = (m->delay + m->duration) * NSEC_PER_MSEC;
+   if (period == 0)
+      return false;
+   int64_t k = (t - m->start) / period;
+   return k < m->repetitions && t - m->start - k * period < m->duration * NSEC_PER_MSEC;
+}
+
+// the level at t of a model that is playing then
+static int32_t ff_model_level(const struct ff_model *m, int64_t t)
+{
+   int64_t play = m->start;
+   if (!m->forever)
+      play += (t - m->start) / ((m->delay + m->duration) * NSEC_PER_MSEC) * (m->delay + m->duration) * NSEC_PER_MSEC;
+   int64_t elapsed = (t - play) / NSEC_PER_MSEC;
+   int64_t remaining = (play + m->duration * NSEC_PER_MSEC - t) / NSEC_PER_MSEC;
+   if (elapsed < m->attack)
+      return m->level * elapsed / m->attack;
+   if (!m->forever && remaining < m->fade)
+      return m->level * remaining / m->fade;
+   return m->level;
+}
+
+// the next time after t the model starts or stops playing
+static int64_t ff_model_next(const struct ff_model *m, int64_t t)
+{
+   if (m->repetitions == 0)
+      return INT64_MAX;
+   if (t < m->start)
+      return m->start;
+   int64_t period = (m->delay + m->duration) * NSEC_PER_MSEC;
+   if (m->forever || period == 0)
+      return INT64_MAX;
+   int64_t k = (t - m->start) / period;
+   if (k >= m->repetitions)
+      return INT64_MAX;
+   int64_t play_end = m->start + k * period + m->duration * NSEC_PER_MSEC;
+   if (t < play_end)
+      return play_end;
+   return k + 1 < m->repetitions ? m->start + (k + 1) * period : INT64_MAX;
+}
+
+static void ff_model_set(struct ff_model *m, const struct ff_effect *effect)
+{
+   bool stop = effect->type == FF_PERIODIC ? effect->u.periodic.magnitude == 0
+      : effect->u.rumble.strong_magnitude == 0 && effect->u.rumble.weak_magnitude == 0;
+   m->forever = !stop && effect->replay.length == 0;
+   m->duration = stop ? 0 : effect->replay.length;
+   m->delay = effect->replay.delay;
+   m->level = effect->type == FF_PERIODIC ? abs(effect->u.periodic.offset * 2) + abs(effect->u.periodic.magnitude) * 2
+      : effect->u.rumble.strong_magnitude + effect->u.rumble.weak_magnitude / 2;
+   m->attack = effect->type == FF_PERIODIC ? effect->u.periodic.envelope.attack_length : 0;
+   m->fade = effect->type == FF_PERIODIC ? effect->u.periodic.envelope.fade_length : 0;
+}
+
+// an updated effect plays the current or next play once with its new
+// parameters, from when that play started or starts
+static void ff_model_update(struct ff_model *m, const struct ff_effect *effect, int64_t now)
+{
+   if (m->repetitions > 0 && now >= m->start && !m->forever)
    {
-      uinput_destroy(i, port);
+      int64_t period = (m->delay + m->duration) * NSEC_PER_MSEC;
+      int64_t k = period > 0 ? (now - m->start) / period : m->repetitions;
+      int64_t play = m->start + k * period;
+      if (k < m->repetitions && now >= play + m->duration * NSEC_PER_MSEC)
+      {
+         k++;
+         play += period;
+      }
+      if (k >= m->repetitions)
+         m->repetitions = 0;
+      m->start = play;
    }
+   if (m->repetitions > 0)
+      m->repetitions = 1;
+   ff_model_set(m, effect);
+}
 
-   if (!port->connected)
-      return;
+static void sim_random_effect(struct ff_effect *effect)
+{
+   uint32_t r = synthetic_random();
+   memset(effect, 0, sizeof(*effect));
+   // a tenth of the effects are silent, which stops them
+   bool silent = r % 10 == 0;
+   if (r & 0x10)
+   {
+      effect->type = FF_RUMBLE;
+      effect->u.rumble.strong_magnitude = silent ? 0 : r >> 16;
+      effect->u.rumble.weak_magnitude = silent ? 0 : r >> 20;
+   }
+   else
+   {
+      effect->type = FF_PERIODIC;
+      effect->u.periodic.waveform = FF_SINE + (r >> 5) % 4;
+      effect->u.periodic.magnitude = silent ? 0 : 1 + (r >> 17);
+      effect->u.periodic.period = 10 + (r >> 8) % 90;
+      // ramps from and to nothing, some so slow the motor stays off a while
+      uint32_t env = synthetic_random();
+      effect->u.periodic.envelope.attack_length = env & 1 ? (env >> 2) % 300 : 0;
+      effect->u.periodic.envelope.fade_length = env & 2 ? (env >> 12) % 300 : 0;
+      if (env & 0x80000000)
+         effect->u.periodic.magnitude = (effect->u.periodic.magnitude & 0x7) + !silent;
+   }
+   r = synthetic_random();
+   // some last forever, many start right away
+   effect->replay.length = r % 10 == 0 ? 0 : 1 + (r >> 4) % 1000;
+   effect->replay.delay = r & 0x4000 ? 0 : (r >> 16) % 300;
+}
 
-   port->extra_power = ((status & 0x04) != 0);
+// one random request on a random port, the way handle_ff_event() would
+// pass it on, and what the model makes of it; returns whether the two
+// agreed on the effect id
+static bool sim_ff_request(struct adapter *a, struct ff_model *models, int *gains, int64_t now)
+{
+   uint32_t r = synthetic_random();
+   int i = r & 3;
+   struct ports *port = &a->controllers[i];
+   struct ff_model *m = &models[i * ff_effects_max];
+   int id = (r >> 2) % ff_effects_max;
+   int kind = (r >> 8) % 16;
+   // uploads and erases skip handle_ff_event(), which does this first
+   ff_run(a, now);
 
-   if (type != port->type)
+   if (kind < 3 || !m[id].in_use)
    {
-      fprintf(stderr, "controller on port %d changed controller type???\n", i+1);
-      port->type = type;
+      struct uinput_ff_upload upload;
+      memset(&upload, 0, sizeof(upload));
+      sim_random_effect(&upload.effect);
+      bool update = kind > 0 && m[id].in_use;
+      if (update)
+      {
+         upload.old.type = upload.effect.type;
+         upload.old.id = id;
+         ff_model_update(&m[id], &upload.effect, now);
+      }
+      else
+      {
+         // the lowest free slot
+         for (id = 0; id < ff_effects_max && m[id].in_use; id++)
+            ;
+         if (id == ff_effects_max)
+            id = -1;
+         if (id >= 0)
+         {
+            m[id].in_use = true;
+            m[id].repetitions = 0;
+            ff_model_set(&m[id], &upload.effect);
+         }
+      }
+      return create_ff_event(port, &upload) == id;
    }
 
-   struct input_event events[12+6+1] = {0}; // buttons + axis + syn event
-   int e_count = 0;
+   struct input_event e;
+   memset(&e, 0, sizeof(e));
+   e.type = EV_FF;
+   if (kind < 12)
+   {
+      // play a few times, or stop
+      e.code = id;
+      e.value = kind == 11 ? 0 : 1 + (r >> 12) % 4;
+      m[id].repetitions = e.value;
+      m[id].start = now + m[id].delay * NSEC_PER_MSEC;
+      handle_ff_event(i, port, &e, now);
+   }
+   else if (kind < 14)
+   {
+      m[id].in_use = false;
+      m[id].repetitions = 0;
+      erase_ff_event(port, id);
+   }
+   else
+   {
+      // any gain but none leaves the motor running
+      e.code = FF_GAIN;
+      e.value = r & 0x10000 ? 0 : r >> 16;
+      gains[i] = e.value;
+      handle_ff_event(i, port, &e, now);
+   }
+   return true;
+}
 
-   uint16_t btns = (uint16_t) payload[1] << 8 | (uint16_t) payload[2];
+// hours of reports at 1 kHz and random force feedback requests about every
+// request_msec on virtual time, stepping straight to the next report,
+// request or effect deadline. Every rumble packet that goes out is checked
+// against the model; PWM has no closed form, so the motors run on/off.
+// Returns the number of mismatches
+static uint64_t bench_ff_simulation(const char *name, int64_t span, int request_msec)
+{
+   int saved_pwm_hz = rumble_pwm_hz;
+   bool saved_single_thread = single_thread;
+   rumble_pwm_hz = 0;
+   // the simulation steps to the deadlines itself, no timerfd
+   single_thread = false;
+   clock_source = virtual_clock;
 
-   for (int j = 0; j < 16; j++)
+   struct adapter *a = create_synthetic_adapter();
+   a->slot = 0;
+   struct ff_model *models = calloc(4 * ff_effects_max, sizeof(struct ff_model));
+   if (models == NULL)
    {
-      if (BUTTON_OFFSET_VALUES[j] == -1)
-         continue;
+      fprintf(stderr, "FATAL: calloc() failed\n");
+      exit(-1);
+   }
+   for (int i = 0; i < 4; i++)
+   {
+      struct ports *port = &a->controllers[i];
+      port->uinput = open("/dev/null", O_WRONLY);
+      port->type = STATE_NORMAL;
+      port->connected = true;
+      port->ff_gain = 0xffff;
+   }
 
-      uint16_t mask = (1 << j);
-      uint16_t pressed = btns & mask;
+   int gains[4] = { 0xffff, 0xffff, 0xffff, 0xffff };
+   uint64_t reports = 0, requests = 0, mismatches = 0;
+   int64_t t = NSEC_PER_SEC, end_time = t + span;
+   int64_t next_report = t, next_request = t;
+   int64_t start = monotonic_ns();
+   while (t < end_time)
+   {
+      virtual_now = t;
+      while (next_request <= t)
+      {
+         if (!sim_ff_request(a, models, gains, t))
+            mismatches++;
+         requests++;
+         // half of them land on a millisecond, where deadlines pile up
+         uint32_t r = synthetic_random();
+         int64_t gap = (r >> 1) % (2 * request_msec * NSEC_PER_MSEC);
+         next_request += r & 1 ? gap - gap % NSEC_PER_MSEC : gap;
+      }
 
-      if ((port->buttons & mask) != pressed)
+      if (next_report <= t)
       {
-         events[e_count].type = EV_KEY;
-         events[e_count].code = BUTTON_OFFSET_VALUES[j];
-         events[e_count].value = (pressed == 0) ? 0 : 1;
-         e_count++;
-         port->buttons &= ~mask;
-         port->buttons |= pressed;
+         struct report r;
+         r.size = REPORT_SIZE;
+         r.time = t;
+         synthetic_report(a->synthetic, r.data);
+         a->synthetic->tick++;
+         process_report(a, &r);
+         reports++;
+         next_report += NSEC_PER_MSEC;
+      }
+      else
+      {
+         ff_update(a, t);
+      }
+      synthetic_complete_rumble(a);
+
+      int64_t next = next_report < next_request ? next_report : next_request;
+      int64_t deadline = ff_next_deadline(a);
+      next = deadline < next ? deadline : next;
+      for (int i = 0; i < 4; i++)
+      {
+         int32_t level = 0;
+         for (int j = 0; j < ff_effects_max; j++)
+         {
+            const struct ff_model *m = &models[i * ff_effects_max + j];
+            int64_t change = ff_model_next(m, t);
+            if (ff_model_playing(m, t))
+               level += ff_model_level(m, t);
+            next = change < next ? change : next;
+         }
+         level = level > FF_LEVEL_MAX ? FF_LEVEL_MAX : level;
+         bool on = level > 0 && gains[i] > 0;
+         if (a->rumble_buffer[i + 1] != on && mismatches++ < 10)
+         {
+            fprintf(stderr, "%s: port %d motor %s at %.6f s, expected %s\n", name, i + 1,
+                  a->rumble_buffer[i + 1] ? "on" : "off", (double)t / NSEC_PER_SEC, on ? "on" : "off");
+         }
       }
+      t = next;
    }
+   int64_t end = monotonic_ns();
 
-   for (int j = 0; j < 6; j++)
+   char extra[192];
+   snprintf(extra, sizeof(extra), ",\"simulated_s\":%lld,\"speedup\":%.0f,\"requests\":%llu,\"rumble_packets\":%llu,\"mismatches\":%llu",
+         (long long)(span / NSEC_PER_SEC), (double)span / (end - start), (unsigned long long)requests,
+         (unsigned long long)a->rumble_packets, (unsigned long long)mismatches);
+   bench_result(name, reports, end - start, extra);
+
+   for (int i = 0; i < 4; i++)
    {
-      unsigned char value = payload[j+3];
+      close(a->controllers[i].uinput);
+      a->controllers[i].connected = false;
+   }
+   free_adapter(a);
+   free(models);
+   clock_source = monotonic_ns;
+   single_thread = saved_single_thread;
+   rumble_pwm_hz = saved_pwm_hz;
+   return mismatches;
+}
 
-      if (AXIS_OFFSET_VALUES[j] == ABS_Y || AXIS_OFFSET_VALUES[j] == ABS_RY)
-         value ^= 0xFF; // flip from 0 - 255 to 255 - 0
+// --synthetic-faults against the real recovery path, in real time: transfer
+// errors and rumble writes that fail to submit while the game turns the
+// motors on and off every so often; outside a recovery the motors must not
+// stay off the last state asked for, and every adapter has to come back in
+// the end. How long they may lag is counted in reports, so a stalled
+// machine doesn't fail it
+static uint64_t bench_recovery(void)
+{
+   int saved_faults = synthetic_faults;
+   int saved_pwm_hz = rumble_pwm_hz;
+   synthetic_faults = 20;
+   rumble_pwm_hz = 0;
 
-      if (port->axis[j] != value)
+   struct adapter *bench_adapters[8];
+   uint64_t wrong_since[8] = { 0 };
+   for (int n = 0; n < 8; n++)
+   {
+      struct adapter *a = create_synthetic_adapter();
+      for (int i = 0; i < 4 && uinput_path == NULL; i++)
       {
-         events[e_count].type = EV_ABS;
-         events[e_count].code = AXIS_OFFSET_VALUES[j];
-         events[e_count].value = value;
-         e_count++;
-         port->axis[j] = value;
+         struct ports *port = &a->controllers[i];
+         port->uinput = open("/dev/null", O_WRONLY);
+         port->type = STATE_NORMAL;
+         port->connected = true;
+         port->ff_gain = 0xffff;
       }
+      start_adapter(a);
+      bench_adapters[n] = a;
    }
 
-   if (e_count > 0)
+   unsigned char rumble[5] = { 0x11, 0, 0, 0, 0 };
+   uint64_t ticks = 0, mismatches = 0;
+   int64_t start = now_ns(), settle = 0, now;
+   for (;;)
    {
-      events[e_count].type = EV_SYN;
-      events[e_count].code = SYN_REPORT;
-      e_count++;
-      size_t to_write = sizeof(events[0]) * e_count;
-      size_t written = 0;
-      while (written < to_write)
+      if (settle == 0 && ticks % 128 == 0)
       {
-         ssize_t write_ret = write(port->uinput, (const char*)events + written, to_write - written);
-         if (write_ret < 0)
+         int i = ticks / 128 % 4;
+         rumble[i + 1] ^= 1;
+         // as uhid output reports, the next report sends it
+         for (int n = 0; n < 8; n++)
+            set_hid_rumble(&bench_adapters[n]->controllers[i], rumble[i + 1] ? 255 : 0);
+      }
+      synthetic_step(1);
+      ticks++;
+      // about the report rate, and the recovery jobs come back through here
+      event_loop_run(1);
+      reap_adapters();
+
+      now = now_ns();
+      bool settled = true;
+      for (int n = 0; n < 8; n++)
+      {
+         struct adapter *a = bench_adapters[n];
+         bool idle = a->recovery == RECOVERY_NONE && !a->rumble_in_flight;
+         settled = settled && idle && !a->rumble_queued;
+         if (!idle || memcmp(a->synthetic->motors, &rumble[1], 4) == 0)
+            wrong_since[n] = 0;
+         else if (wrong_since[n] == 0)
+            wrong_since[n] = ticks;
+         else if (ticks - wrong_since[n] >= 64)
          {
-            perror("Warning: writing input events failed");
-            break;
+            if (mismatches++ < 10)
+               fprintf(stderr, "recovery: adapter %s motors %d%d%d%d for %llu reports, expected %d%d%d%d\n", a->name,
+                     a->synthetic->motors[0], a->synthetic->motors[1], a->synthetic->motors[2], a->synthetic->motors[3],
+                     (unsigned long long)(ticks - wrong_since[n]), rumble[1], rumble[2], rumble[3], rumble[4]);
+            wrong_since[n] = 0;
          }
-         written += write_ret;
       }
+
+      if (settle == 0 && now - start >= 3 * NSEC_PER_SEC)
+      {
+         // no more faults, everything should recover and settle
+         synthetic_faults = 0;
+         settle = now;
+      }
+      if (settle != 0 && (settled || now - settle >= 10 * NSEC_PER_SEC))
+         break;
    }
 
-   // check for rumble events
-   struct input_event e;
-   ssize_t ret = read(port->uinput, &e, sizeof(e));
-   if (ret == sizeof(e))
+   uint64_t errors = 0, recoveries = 0;
+   for (int n = 0; n < 8; n++)
    {
-      if (e.type == EV_UINPUT)
+      struct adapter *a = bench_adapters[n];
+      for (int k = 0; k < ERROR_KINDS; k++)
+         errors += a->errors[k];
+      recoveries += a->recoveries;
+      if (a->recovery != RECOVERY_NONE || a->rumble_queued
+            || memcmp(a->synthetic->motors, &rumble[1], 4) != 0)
       {
-         switch (e.code)
-         {
-            case UI_FF_UPLOAD:
-            {
-               struct uinput_ff_upload upload = { 0 };
-               upload.request_id = e.value;
-               ioctl(port->uinput, UI_BEGIN_FF_UPLOAD, &upload);
-               int id = create_ff_event(port, &upload);
-               if (id < 0)
-               {
-                  // TODO: what's the proper error code for this?
-                  upload.retval = -1;
-               }
-               else
-               {
-                  upload.retval = 0;
-                  upload.effect.id = id;
-               }
-               ioctl(port->uinput, UI_END_FF_UPLOAD, &upload);
-               break;
-            }
-            case UI_FF_ERASE:
-            {
-               struct uinput_ff_erase erase = { 0 };
-               erase.request_id = e.value;
-               ioctl(port->uinput, UI_BEGIN_FF_ERASE, &erase);
-               if (erase.effect_id < MAX_FF_EVENTS)
-                  port->ff_events[erase.effect_id].in_use = false;
-               ioctl(port->uinput, UI_END_FF_ERASE, &erase);
-            }
-         }
+         fprintf(stderr, "recovery: adapter %s did not settle\n", a->name);
+         mismatches++;
       }
-      else if (e.type == EV_FF)
+   }
+   // the faults have to have been there for this to mean anything
+   if (errors == 0 || recoveries == 0)
+   {
+      fprintf(stderr, "recovery: no faults were injected\n");
+      mismatches++;
+   }
+
+   char extra[128];
+   snprintf(extra, sizeof(extra), ",\"errors\":%llu,\"recoveries\":%llu,\"mismatches\":%llu",
+         (unsigned long long)errors, (unsigned long long)recoveries, (unsigned long long)mismatches);
+   bench_result("recovery", ticks, now - start, extra);
+
+   for (int n = 0; n < 8; n++)
+   {
+      struct adapter *a = bench_adapters[n];
+      for (int i = 0; i < 4 && uinput_path == NULL; i++)
       {
-         if (e.code < MAX_FF_EVENTS && port->ff_events[e.code].in_use)
-         {
-            port->ff_events[e.code].repetitions = e.value;
-            update_ff_start_stop(&port->ff_events[e.code], current_time);
-         }
+         close(a->controllers[i].uinput);
+         a->controllers[i].connected = false;
       }
+      remove_adapter(a);
    }
+   while (dying_adapters)
+      reap_adapters();
+   rumble_pwm_hz = saved_pwm_hz;
+   synthetic_faults = saved_faults;
+   return mismatches;
 }
 
-static void *adapter_thread(void *data)
+// the whole report -> decode -> uinput write path on one core
+static void bench_pipeline(unsigned char reports[BENCH_REPORTS][REPORT_SIZE], int count)
 {
-   struct adapter *a = (struct adapter *)data;
+   const char *device_path = output_mode == OUTPUT_UHID ? uhid_path : uinput_path;
+   struct adapter *bench_adapters[MAX_ADAPTERS];
+   for (int n = 0; n < count; n++)
+   {
+      struct adapter *a = create_synthetic_adapter();
+      start_adapter(a);
+      bench_adapters[n] = a;
+      for (int i = 0; i < 4 && device_path == NULL; i++)
+      {
+         // stand-in sink so the write syscalls still happen
+         struct ports *port = &a->controllers[i];
+         port->uinput = open("/dev/null", O_WRONLY);
+         port->type = STATE_NORMAL;
+         port->connected = true;
+         port->ff_gain = 0xffff;
+      }
+   }
 
-    int bytes_transferred;
-    unsigned char payload[1] = { 0x13 };
+   // connect everything outside the timed part
+   for (int n = 0; n < count; n++)
+      adapter_report(bench_adapters[n], reports[0], REPORT_SIZE);
 
-    int transfer_ret = libusb_interrupt_transfer(a->handle, EP_OUT, payload, sizeof(payload), &bytes_transferred, 0);
+   uint64_t ops = 0;
+   int64_t syscalls = count_syscalls();
+   int64_t start = now_ns(), end;
+   do
+   {
+      for (int k = 1; k <= BENCH_REPORTS; k++)
+      {
+         for (int n = 0; n < count; n++)
+            adapter_report(bench_adapters[n], reports[k % BENCH_REPORTS], REPORT_SIZE);
+      }
+      ops += BENCH_REPORTS * count;
+      end = now_ns();
+   } while (end - start < BENCH_MSEC * NSEC_PER_MSEC);
+   int64_t syscalls_end = count_syscalls();
 
-    if (transfer_ret != 0) {
-        fprintf(stderr, "libusb_interrupt_transfer: %s\n", libusb_error_name(transfer_ret));
-        return NULL;
-    }
-    if (bytes_transferred != sizeof(payload)) {
-        fprintf(stderr, "libusb_interrupt_transfer %d/%d bytes transferred.\n", bytes_transferred, sizeof(payload));
-        return NULL;
-    }
+   char name[32], extra[96];
+   snprintf(name, sizeof(name), output_mode == OUTPUT_UHID ? "pipeline_uhid_%d" : "pipeline_%d", count);
+   snprintf(extra, sizeof(extra), ",\"sink\":\"%s\",\"syscalls_per_op\":%.2f",
+         device_path != NULL ? OUTPUT_MODE_NAMES[output_mode] : "null",
+         syscalls < 0 || syscalls_end < 0 ? -1.0 : (double)(syscalls_end - syscalls) / ops);
+   bench_result(name, ops, end - start, extra);
 
-   while (!a->quitting)
+   for (int n = 0; n < count; n++)
    {
-      unsigned char payload[37];
-      int size = 0;
-      int transfer_ret = libusb_interrupt_transfer(a->handle, EP_IN, payload, sizeof(payload), &size, 0);
-      if (transfer_ret != 0) {
-         fprintf(stderr, "libusb_interrupt_transfer error %d\n", transfer_ret);
-         a->quitting = true;
-         break;
+      struct adapter *a = bench_adapters[n];
+      for (int i = 0; i < 4 && device_path == NULL; i++)
+      {
+         close(a->controllers[i].uinput);
+         a->controllers[i].connected = false;
       }
-      if (size != 37 || payload[0] != 0x21)
-         continue;
+      remove_adapter(a);
+   }
+   while (dying_adapters)
+      reap_adapters();
+}
 
-      unsigned char *controller = &payload[1];
+// the same path with the reports handed to the I/O thread pool the way the
+// USB callbacks do, charging only the I/O threads' CPU time per report so
+// the cost of an extra adapter on a thread shows
+static void bench_pool(unsigned char reports[BENCH_REPORTS][REPORT_SIZE], int count)
+{
+   struct adapter *bench_adapters[MAX_ADAPTERS];
+   // stand-in sinks that, unlike /dev/null, never poll readable
+   int sinks[MAX_ADAPTERS][4];
+   for (int n = 0; n < count; n++)
+   {
+      struct adapter *a = create_synthetic_adapter();
+      for (int i = 0; i < 4 && uinput_path == NULL; i++)
+      {
+         struct ports *port = &a->controllers[i];
+         int fds[2];
+         if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0)
+         {
+            perror("FATAL: pipe2() failed");
+            exit(-1);
+         }
+         sinks[n][i] = fds[0];
+         port->uinput = fds[1];
+         port->type = STATE_NORMAL;
+         port->connected = true;
+         port->ff_gain = 0xffff;
+      }
+      start_adapter(a);
+      bench_adapters[n] = a;
+   }
 
-      unsigned char rumble[5] = { 0x11, 0, 0, 0, 0 };
-      struct timespec current_time = { 0 };
-      clock_gettime(CLOCK_MONOTONIC_RAW, &current_time);
-      for (int i = 0; i < 4; i++, controller += 9)
+   uint64_t fed = 0;
+   int64_t cpu_start = 0, cpu_end = 0;
+   int64_t start = 0, end;
+   // the first round connects everything outside the timed part
+   for (int round = 0; ; round++)
+   {
+      if (round == 1)
+      {
+         cpu_start = bench_io_cpu_ns();
+         start = now_ns();
+         fed = 0;
+      }
+      for (int k = 1; k <= BENCH_REPORTS; k++)
       {
-         handle_payload(i, &a->controllers[i], controller, &current_time);
-         rumble[i+1] = 0;
-         if (a->controllers[i].extra_power && a->controllers[i].type == STATE_NORMAL)
+         for (int n = 0; n < count; n++)
+            adapter_report(bench_adapters[n], reports[k % BENCH_REPORTS], REPORT_SIZE);
+         fed += count;
+         // don't run ahead of the pool into the queues' overrun
+         for (int n = 0; n < count; n++)
          {
-            for (int j = 0; j < MAX_FF_EVENTS; j++)
+            struct adapter *a = bench_adapters[n];
+            while (true)
             {
-               struct ff_event *e = &a->controllers[i].ff_events[j];
-               if (e->in_use)
-               {
-                  bool after_start = ts_lessthan(&e->start_time, &current_time);
-                  bool before_end = ts_greaterthan(&e->end_time, &current_time);
-
-                  if (after_start && before_end)
-                     rumble[i+1] = 1;
-                  else if (after_start && !before_end)
-                     update_ff_start_stop(e, &current_time);
-               }
+               pthread_mutex_lock(&a->queue_lock);
+               unsigned queued = a->queue_tail - a->queue_head;
+               pthread_mutex_unlock(&a->queue_lock);
+               if (queued < REPORT_QUEUE_SIZE / 2)
+                  break;
+               sched_yield();
             }
          }
+         if (uinput_path == NULL && k % 16 == 0)
+            bench_drain(sinks, count);
       }
-
-      if (memcmp(rumble, a->rumble, sizeof(rumble)) != 0)
+      end = now_ns();
+      if (round > 0 && end - start >= BENCH_MSEC * NSEC_PER_MSEC)
+         break;
+   }
+   // the rest of the queued reports count too
+   for (int n = 0; n < count; n++)
+   {
+      struct adapter *a = bench_adapters[n];
+      while (true)
       {
-         memcpy(a->rumble, rumble, sizeof(rumble));
-         transfer_ret = libusb_interrupt_transfer(a->handle, EP_OUT, a->rumble, sizeof(a->rumble), &size, 0);
-         if (transfer_ret != 0) {
-            fprintf(stderr, "libusb_interrupt_transfer error %d\n", transfer_ret);
-            a->quitting = true;
+         pthread_mutex_lock(&a->queue_lock);
+         bool empty = a->queue_tail == a->queue_head && a->thread_sleeping;
+         pthread_mutex_unlock(&a->queue_lock);
+         if (empty)
             break;
-         }
+         if (uinput_path == NULL)
+            bench_drain(sinks, count);
+         sched_yield();
       }
    }
+   cpu_end = bench_io_cpu_ns();
+   end = now_ns();
 
-   for (int i = 0; i < 4; i++)
+   char name[32], extra[128];
+   snprintf(name, sizeof(name), "pipeline_pool_%d", count);
+   snprintf(extra, sizeof(extra), ",\"sink\":\"%s\",\"io_threads\":%d,\"io_cpu_ns_per_op\":%.1f",
+         uinput_path != NULL ? "uinput" : "pipe", io_thread_count,
+         cpu_start < 0 ? -1.0 : (double)(cpu_end - cpu_start) / fed);
+   bench_result(name, fed, end - start, extra);
+
+   for (int n = 0; n < count; n++)
    {
-      if (a->controllers[i].connected)
-         uinput_destroy(i, &a->controllers[i]);
+      struct adapter *a = bench_adapters[n];
+      remove_adapter(a);
+      // the I/O thread closes the sinks as it lets go of the adapter
+      pthread_mutex_lock(&a->io->lock);
+      while (!a->released)
+         pthread_cond_wait(&a->io->released, &a->io->lock);
+      pthread_mutex_unlock(&a->io->lock);
+      for (int i = 0; i < 4 && uinput_path == NULL; i++)
+         close(sinks[n][i]);
    }
-
-   return NULL;
+   while (dying_adapters)
+      reap_adapters();
 }
 
-static void add_adapter(struct libusb_device *dev)
+static int run_bench(void)
 {
-   struct adapter *a = calloc(1, sizeof(struct adapter));
-   if (a == NULL)
-   {
-      fprintf(stderr, "FATAL: calloc() failed\n");
-      exit(-1);
-   }
-   a->device = dev;
+   // reports are decoded as they are fed in, with no thread handoff, up to
+   // the pool runs
+   single_thread = true;
+   if (access("/dev/uinput", W_OK) == 0)
+      uinput_path = "/dev/uinput";
+   else
+      fprintf(stderr, "/dev/uinput not writable, writing events to /dev/null\n");
+   if (access("/dev/uhid", W_OK) == 0)
+      uhid_path = "/dev/uhid";
+   else
+      fprintf(stderr, "/dev/uhid not writable, writing HID reports to /dev/null\n");
 
-   if (libusb_open(a->device, &a->handle) != 0)
-   {
-      fprintf(stderr, "Error opening device %p\n", a->device);
-      return;
-   }
+   libusb_init(NULL);
+   if (!event_loop_init() || !hotplug_init())
+      return -1;
 
-   if (libusb_kernel_driver_active(a->handle, 0) == 1) {
-       fprintf(stderr, "Detaching kernel driver\n");
-       if (libusb_detach_kernel_driver(a->handle, 0)) {
-           fprintf(stderr, "Error detaching handle %p from kernel\n", a->handle);
-           return;
-       }
-   }
+   unsigned char reports[BENCH_REPORTS][REPORT_SIZE];
+   bench_reports(reports);
 
-   struct adapter *old_head = adapters.next;
-   adapters.next = a;
-   a->next = old_head;
+   bench_diff("report_diff", report_diff, reports);
+   bench_diff("report_diff_scalar", report_diff_scalar, reports);
+   uint64_t mismatches = bench_diff_check();
+   mismatches += bench_event_check();
+   bench_decode(reports);
+   bench_ff_level();
+   bench_rumble();
+   mismatches += bench_ff_simulation("ff_simulation", 2 * 3600 * NSEC_PER_SEC, 100);
+   mismatches += bench_ff_simulation("ff_simulation_churn", 600 * NSEC_PER_SEC, 1);
+   mismatches += bench_recovery();
+   enum output_mode saved_output = output_mode;
+   for (int mode = OUTPUT_UINPUT; mode < OUTPUT_MODES; mode++)
+   {
+      output_mode = mode;
+      bench_pipeline(reports, 1);
+      bench_pipeline(reports, 4);
+      bench_pipeline(reports, 16);
+   }
+   output_mode = saved_output;
 
-   pthread_create(&a->thread, NULL, adapter_thread, a);
+   // and once more through the I/O threads
+   single_thread = false;
+   io_threads_init();
+   bench_pool(reports, 1);
+   bench_pool(reports, 4);
+   bench_pool(reports, 16);
+   hotplug_exit();
+   io_threads_exit();
 
-   fprintf(stderr, "adapter %p connected\n", a->device);
+   libusb_set_pollfd_notifiers(NULL, NULL, NULL, NULL);
+   close(epoll_fd);
+   libusb_exit(NULL);
+   return mismatches > 0;
 }
 
-static void remove_adapter(struct libusb_device *dev)
+// the adapters already plugged in, without hotplug events to report them
+static void scan_adapters(void)
 {
-   struct adapter *a = &adapters;
-   while (a->next != NULL)
-   {
-      if (a->next->device == dev)
-      {
-         a->next->quitting = true;
-         pthread_join(a->next->thread, NULL);
-         fprintf(stderr, "adapter %p disconnected\n", a->next->device);
-         libusb_close(a->next->handle);
-         struct adapter *new_next = a->next->next;
-         free(a->next);
-         a->next = new_next;
-         return;
-      }
+   struct libusb_device **devices;
+
+   int count = libusb_get_device_list(NULL, &devices);
 
-      a = a->next;
+   for (int i = 0; i < count; i++)
+   {
+      struct libusb_device_descriptor desc;
+      libusb_get_device_descriptor(devices[i], &desc);
+      if (desc.idVendor == vendor_id && desc.idProduct == product_id)
+         add_adapter(devices[i]);
    }
+
+   if (count > 0)
+      libusb_free_device_list(devices, 1);
 }
 
 static int LIBUSB_CALL hotplug_callback(struct libusb_context *ctx, struct libusb_device *dev, libusb_hotplug_event event, void *user_data)
@@ -605,7 +7108,7 @@ static int LIBUSB_CALL hotplug_callback(struct libusb_context *ctx, struct libus
    }
    else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
    {
-      remove_adapter(dev);
+      remove_usb_adapter(dev);
    }
 
    return 0;
@@ -617,6 +7120,18 @@ static void quitting_signal(int sig)
    quitting = 1;
 }
 
+static void stats_signal(int sig)
+{
+   (void)sig;
+   stats_requested = 1;
+}
+
+static void reload_signal(int sig)
+{
+   (void)sig;
+   reload_requested = 1;
+}
+
 static uint16_t parse_id(const char* str)
 {
    char* endptr = NULL;
@@ -631,15 +7146,184 @@ static uint16_t parse_id(const char* str)
    return out;
 }
 
+// comma separated adapter locations (as in "adapter 1-3.2 connected"),
+// the first gets ports 1-4 and so on; an empty entry leaves a slot open
+static bool parse_slots(const char *str)
+{
+   int n = 0;
+   while (*str != '\0')
+   {
+      size_t len = strcspn(str, ",");
+      if (n == MAX_ADAPTERS || len >= sizeof(slot_locations[n]))
+         return false;
+      memcpy(slot_locations[n], str, len);
+      slot_locations[n][len] = '\0';
+      n++;
+      str += len;
+      if (*str == ',')
+         str++;
+   }
+   return n > 0;
+}
+
+static bool parse_cpus(const char *str, cpu_set_t *set)
+{
+   CPU_ZERO(set);
+   while (*str != '\0')
+   {
+      char *end;
+      long first = strtol(str, &end, 10);
+      long last = first;
+      if (end == str)
+         return false;
+      if (*end == '-')
+      {
+         str = end + 1;
+         last = strtol(str, &end, 10);
+         if (end == str)
+            return false;
+      }
+      if (first < 0 || last < first || last >= CPU_SETSIZE)
+         return false;
+      for (long cpu = first; cpu <= last; cpu++)
+         CPU_SET(cpu, set);
+      if (*end == ',')
+         end++;
+      else if (*end != '\0')
+         return false;
+      str = end;
+   }
+   return CPU_COUNT(set) > 0;
+}
+
+// apply the scheduling options to the calling (event loop) thread, I/O
+// threads created later inherit them; settings that can't be applied are
+// dropped with a warning
+static void realtime_init(void)
+{
+   if (rt_priority > 0)
+   {
+      struct sched_param param = { .sched_priority = rt_priority };
+      int ret = pthread_setschedparam(pthread_self(), rt_policy, &param);
+      if (ret != 0)
+      {
+         fprintf(stderr, "Warning: cannot use %s priority %d: %s\n",
+               rt_policy == SCHED_RR ? "SCHED_RR" : "SCHED_FIFO", rt_priority, strerror(ret));
+         rt_priority = 0;
+      }
+      else
+      {
+         fprintf(stderr, "I/O threads run as %s priority %d\n",
+               rt_policy == SCHED_RR ? "SCHED_RR" : "SCHED_FIFO", rt_priority);
+      }
+   }
+
+   if (CPU_COUNT(&rt_cpus) > 0)
+   {
+      int ret = pthread_setaffinity_np(pthread_self(), sizeof(rt_cpus), &rt_cpus);
+      if (ret != 0)
+         fprintf(stderr, "Warning: cannot pin I/O threads to --cpus: %s\n", strerror(ret));
+      else
+         fprintf(stderr, "I/O threads pinned to CPUs %s\n", rt_cpu_list);
+   }
+
+   if (rt_mlock)
+   {
+      if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+         perror("Warning: mlockall");
+      else
+         fprintf(stderr, "memory locked\n");
+   }
+
+   if (dma_latency >= 0)
+   {
+      // the request holds for as long as the file stays open
+      int32_t value = dma_latency;
+      dma_latency_fd = open("/dev/cpu_dma_latency", O_WRONLY | O_CLOEXEC);
+      if (dma_latency_fd < 0 || write(dma_latency_fd, &value, sizeof(value)) != sizeof(value))
+      {
+         perror("Warning: /dev/cpu_dma_latency");
+         if (dma_latency_fd >= 0)
+            close(dma_latency_fd);
+         dma_latency_fd = -1;
+      }
+      else
+      {
+         fprintf(stderr, "CPU wakeup latency limited to %d us\n", dma_latency);
+      }
+   }
+}
+
 enum {
    opt_vendor = 1000,
    opt_product,
+   opt_ff_effects,
+   opt_rumble_pwm,
+   opt_calibration,
+   opt_stats_interval,
+   opt_synthetic,
+   opt_synthetic_rate,
+   opt_synthetic_file,
+   opt_synthetic_churn,
+   opt_bench,
+   opt_record,
+   opt_replay,
+   opt_replay_fast,
+   opt_rt_priority,
+   opt_rt_policy,
+   opt_cpus,
+   opt_mlock,
+   opt_dma_latency,
+   opt_shm,
+   opt_replug_grace,
+   opt_port_grace,
+   opt_precreate,
+   opt_profile,
+   opt_io_threads,
+   opt_slots,
+   opt_emit,
+   opt_emit_rate,
+   opt_synthetic_faults,
+   opt_control,
+   opt_output,
 };
 
 static struct option options[] = {
    { "raw", no_argument, 0, 'r' },
+   { "transfers", required_argument, 0, 't' },
+   { "single-thread", no_argument, 0, 's' },
+   { "verbose", no_argument, 0, 'v' },
    { "vendor", required_argument, 0, opt_vendor },
    { "product", required_argument, 0, opt_product },
+   { "ff-effects", required_argument, 0, opt_ff_effects },
+   { "rumble-pwm", required_argument, 0, opt_rumble_pwm },
+   { "calibration", required_argument, 0, opt_calibration },
+   { "stats-interval", required_argument, 0, opt_stats_interval },
+   { "synthetic", required_argument, 0, opt_synthetic },
+   { "synthetic-rate", required_argument, 0, opt_synthetic_rate },
+   { "synthetic-file", required_argument, 0, opt_synthetic_file },
+   { "synthetic-churn", required_argument, 0, opt_synthetic_churn },
+   { "bench", no_argument, 0, opt_bench },
+   { "record", required_argument, 0, opt_record },
+   { "replay", required_argument, 0, opt_replay },
+   { "replay-fast", no_argument, 0, opt_replay_fast },
+   { "rt-priority", required_argument, 0, opt_rt_priority },
+   { "rt-policy", required_argument, 0, opt_rt_policy },
+   { "cpus", required_argument, 0, opt_cpus },
+   { "mlock", no_argument, 0, opt_mlock },
+   { "dma-latency", required_argument, 0, opt_dma_latency },
+   { "shm", required_argument, 0, opt_shm },
+   { "replug-grace", required_argument, 0, opt_replug_grace },
+   { "port-grace", required_argument, 0, opt_port_grace },
+   { "precreate", no_argument, 0, opt_precreate },
+   { "profile", required_argument, 0, opt_profile },
+   { "io-threads", required_argument, 0, opt_io_threads },
+   { "slots", required_argument, 0, opt_slots },
+   { "emit", required_argument, 0, opt_emit },
+   { "emit-rate", required_argument, 0, opt_emit_rate },
+   { "synthetic-faults", required_argument, 0, opt_synthetic_faults },
+   { "control", required_argument, 0, opt_control },
+   { "output", required_argument, 0, opt_output },
    { 0, 0, 0, 0 },
 };
 
@@ -649,11 +7333,12 @@ int main(int argc, char *argv[])
    struct udev_device *uinput;
    struct sigaction sa;
 
+   startup_time = now_ns();
    memset(&sa, 0, sizeof(sa));
 
    while (1) {
       int option_index = 0;
-      int c = getopt_long(argc, argv, "r", options, &option_index);
+      int c = getopt_long(argc, argv, "rt:sv", options, &option_index);
       if (c == -1)
          break;
 
@@ -662,6 +7347,22 @@ int main(int argc, char *argv[])
          fprintf(stderr, "raw mode enabled\n");
          raw_mode = true;
          break;
+      case 't':
+         num_in_transfers = atoi(optarg);
+         if (num_in_transfers < 1 || num_in_transfers > MAX_IN_TRANSFERS)
+         {
+            fprintf(stderr, "Invalid transfer count \"%s\" (1-%d)\n", optarg, MAX_IN_TRANSFERS);
+            return 1;
+         }
+         fprintf(stderr, "%d IN transfers per adapter\n", num_in_transfers);
+         break;
+      case 's':
+         fprintf(stderr, "single-thread mode enabled\n");
+         single_thread = true;
+         break;
+      case 'v':
+         verbose = true;
+         break;
       case opt_vendor:
          vendor_id = parse_id(optarg);
          fprintf(stderr, "vendor_id = %#06x\n", vendor_id);
@@ -670,6 +7371,198 @@ int main(int argc, char *argv[])
          product_id = parse_id(optarg);
          fprintf(stderr, "product_id = %#06x\n", product_id);
          break;
+      case opt_ff_effects:
+         ff_effects_max = atoi(optarg);
+         if (ff_effects_max < 1 || ff_effects_max > MAX_FF_EFFECTS)
+         {
+            fprintf(stderr, "Invalid effect count \"%s\" (1-%d)\n", optarg, MAX_FF_EFFECTS);
+            return 1;
+         }
+         fprintf(stderr, "%d force feedback effects per port\n", ff_effects_max);
+         break;
+      case opt_stats_interval:
+         stats_interval = atoi(optarg);
+         if (stats_interval < 0)
+         {
+            fprintf(stderr, "Invalid stats interval \"%s\"\n", optarg);
+            return 1;
+         }
+         break;
+      case opt_calibration:
+         calibration_path = optarg;
+         break;
+      case opt_rumble_pwm:
+         rumble_pwm_hz = atoi(optarg);
+         if (rumble_pwm_hz < 0 || rumble_pwm_hz > MAX_RUMBLE_PWM_HZ)
+         {
+            fprintf(stderr, "Invalid PWM rate \"%s\" (0-%d)\n", optarg, MAX_RUMBLE_PWM_HZ);
+            return 1;
+         }
+         fprintf(stderr, "rumble PWM at %d Hz\n", rumble_pwm_hz);
+         break;
+      case opt_synthetic:
+         synthetic_count = atoi(optarg);
+         if (synthetic_count < 1)
+         {
+            fprintf(stderr, "Invalid synthetic adapter count \"%s\"\n", optarg);
+            return 1;
+         }
+         break;
+      case opt_synthetic_rate:
+         synthetic_rate = atoi(optarg);
+         if (synthetic_rate < 1 || synthetic_rate > MAX_SYNTHETIC_RATE)
+         {
+            fprintf(stderr, "Invalid report rate \"%s\" (1-%d)\n", optarg, MAX_SYNTHETIC_RATE);
+            return 1;
+         }
+         break;
+      case opt_synthetic_file:
+         synthetic_path = optarg;
+         break;
+      case opt_synthetic_churn:
+         synthetic_churn = atoi(optarg);
+         if (synthetic_churn < 0)
+         {
+            fprintf(stderr, "Invalid churn interval \"%s\"\n", optarg);
+            return 1;
+         }
+         break;
+      case opt_synthetic_faults:
+         synthetic_faults = atoi(optarg);
+         if (synthetic_faults < 0 || synthetic_faults > MAX_SYNTHETIC_FAULTS)
+         {
+            fprintf(stderr, "Invalid fault rate \"%s\" (0-%d)\n", optarg, MAX_SYNTHETIC_FAULTS);
+            return 1;
+         }
+         break;
+      case opt_bench:
+         bench_mode = true;
+         break;
+      case opt_record:
+         capture_path = optarg;
+         break;
+      case opt_replay:
+         replay_path = optarg;
+         break;
+      case opt_replay_fast:
+         // the report queues can't absorb an unthrottled replay
+         replay_fast = true;
+         single_thread = true;
+         break;
+      case opt_rt_priority:
+         rt_priority = atoi(optarg);
+         if (rt_priority < sched_get_priority_min(SCHED_FIFO) || rt_priority > sched_get_priority_max(SCHED_FIFO))
+         {
+            fprintf(stderr, "Invalid real-time priority \"%s\" (%d-%d)\n", optarg,
+                  sched_get_priority_min(SCHED_FIFO), sched_get_priority_max(SCHED_FIFO));
+            return 1;
+         }
+         break;
+      case opt_rt_policy:
+         if (strcmp(optarg, "fifo") == 0)
+            rt_policy = SCHED_FIFO;
+         else if (strcmp(optarg, "rr") == 0)
+            rt_policy = SCHED_RR;
+         else
+         {
+            fprintf(stderr, "Invalid scheduling policy \"%s\" (fifo or rr)\n", optarg);
+            return 1;
+         }
+         break;
+      case opt_cpus:
+         if (!parse_cpus(optarg, &rt_cpus))
+         {
+            fprintf(stderr, "Invalid CPU list \"%s\"\n", optarg);
+            return 1;
+         }
+         rt_cpu_list = optarg;
+         break;
+      case opt_mlock:
+         rt_mlock = true;
+         break;
+      case opt_shm:
+         shm_path = optarg;
+         break;
+      case opt_control:
+         control_path = optarg;
+         break;
+      case opt_output:
+         if (strcmp(optarg, "uinput") == 0)
+            output_mode = OUTPUT_UINPUT;
+         else if (strcmp(optarg, "uhid") == 0)
+            output_mode = OUTPUT_UHID;
+         else
+         {
+            fprintf(stderr, "Invalid output \"%s\" (uinput or uhid)\n", optarg);
+            return 1;
+         }
+         break;
+      case opt_replug_grace:
+         replug_grace_msec = atoi(optarg);
+         if (replug_grace_msec < 0)
+         {
+            fprintf(stderr, "Invalid replug grace period \"%s\"\n", optarg);
+            return 1;
+         }
+         break;
+      case opt_port_grace:
+         port_grace_msec = atoi(optarg);
+         if (port_grace_msec < 0)
+         {
+            fprintf(stderr, "Invalid port grace period \"%s\"\n", optarg);
+            return 1;
+         }
+         break;
+      case opt_precreate:
+         precreate_ports = true;
+         break;
+      case opt_profile:
+         profile_path = optarg;
+         break;
+      case opt_io_threads:
+         io_thread_max = atoi(optarg);
+         if (io_thread_max < 1 || io_thread_max > MAX_ADAPTERS)
+         {
+            fprintf(stderr, "Invalid I/O thread count \"%s\" (1-%d)\n", optarg, MAX_ADAPTERS);
+            return 1;
+         }
+         break;
+      case opt_emit:
+         if (strcmp(optarg, "latency") == 0)
+            emit_mode = EMIT_LATENCY;
+         else if (strcmp(optarg, "rate") == 0)
+            emit_mode = EMIT_RATE;
+         else if (strcmp(optarg, "jitter") == 0)
+            emit_mode = EMIT_JITTER;
+         else
+         {
+            fprintf(stderr, "Invalid emission mode \"%s\" (latency, rate or jitter)\n", optarg);
+            return 1;
+         }
+         break;
+      case opt_emit_rate:
+         emit_rate_hz = atoi(optarg);
+         if (emit_rate_hz < 1 || emit_rate_hz > MAX_EMIT_RATE)
+         {
+            fprintf(stderr, "Invalid emission rate \"%s\" (1-%d)\n", optarg, MAX_EMIT_RATE);
+            return 1;
+         }
+         break;
+      case opt_slots:
+         if (!parse_slots(optarg))
+         {
+            fprintf(stderr, "Invalid slot list \"%s\" (up to %d locations)\n", optarg, MAX_ADAPTERS);
+            return 1;
+         }
+         break;
+      case opt_dma_latency:
+         dma_latency = atoi(optarg);
+         if (dma_latency < 0)
+         {
+            fprintf(stderr, "Invalid latency \"%s\"\n", optarg);
+            return 1;
+         }
+         break;
       }
    }
 
@@ -680,69 +7573,168 @@ int main(int argc, char *argv[])
    sigaction(SIGINT, &sa, NULL);
    sigaction(SIGTERM, &sa, NULL);
 
+   sa.sa_handler = stats_signal;
+   sa.sa_flags = SA_RESTART;
+   sigaction(SIGUSR1, &sa, NULL);
+
+   if (profile_path != NULL)
+   {
+      sa.sa_handler = reload_signal;
+      sigaction(SIGHUP, &sa, NULL);
+   }
+
+   if (calibration_path != NULL && !load_calibration(calibration_path))
+      return 1;
+
+   if (!init_decoder())
+      return 1;
+
+   realtime_init();
+
+   if (bench_mode)
+      return run_bench();
+
    udev = udev_new();
    if (udev == NULL) {
       fprintf(stderr, "udev init errors\n");
       return -1;
    }
 
-   uinput = udev_device_new_from_subsystem_sysname(udev, "misc", "uinput");
+   // both are misc devices named after themselves
+   const char *output_name = OUTPUT_MODE_NAMES[output_mode];
+   uinput = udev_device_new_from_subsystem_sysname(udev, "misc", output_name);
    if (uinput == NULL)
    {
-      fprintf(stderr, "uinput creation failed\n");
+      fprintf(stderr, "%s creation failed\n", output_name);
       return -1;
    }
 
-   uinput_path = udev_device_get_devnode(uinput);
-   if (uinput_path == NULL)
+   const char *output_path = udev_device_get_devnode(uinput);
+   if (output_path == NULL)
    {
-      fprintf(stderr, "cannot find path to uinput\n");
+      fprintf(stderr, "cannot find path to %s\n", output_name);
       return -1;
    }
+   if (output_mode == OUTPUT_UHID)
+      uhid_path = output_path;
+   else
+      uinput_path = output_path;
 
    libusb_init(NULL);
 
-   struct libusb_device **devices;
+   if (!event_loop_init())
+      return -1;
 
-   int count = libusb_get_device_list(NULL, &devices);
+   struct watch stats_watch;
+   if (!stats_init(&stats_watch))
+      return -1;
 
-   for (int i = 0; i < count; i++)
-   {
-      struct libusb_device_descriptor desc;
-      libusb_get_device_descriptor(devices[i], &desc);
-      if (desc.idVendor == USB_ID_VENDOR && desc.idProduct == USB_ID_PRODUCT)
-         add_adapter(devices[i]);
-   }
+   if (!hotplug_init())
+      return -1;
 
-   if (count > 0)
-      libusb_free_device_list(devices, 1);
+   if (!single_thread && !io_threads_init())
+      return -1;
 
    libusb_hotplug_callback_handle callback;
+   int hotplug_capability = 0;
+
+   if (capture_path != NULL && !capture_init(capture_path))
+      return 1;
+
+   if (shm_path != NULL && !shm_init(shm_path))
+      return 1;
+
+   if (control_path != NULL && !control_init(control_path))
+      return 1;
+
+   startup_scanning = true;
+   if (synthetic_count > 0)
+   {
+      if (!synthetic_init())
+         return 1;
+   }
+   else if (replay_path != NULL)
+   {
+      if (!replay_init(replay_path))
+         return 1;
+   }
+   else
+   {
+      hotplug_capability = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG);
+      if (!hotplug_capability)
+         scan_adapters();
+   }
 
-   int hotplug_capability = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG);
    if (hotplug_capability) {
+       // the adapters already plugged in are reported through the callback
+       // too, so none can slip in between a scan and the registration
        int hotplug_ret = libusb_hotplug_register_callback(NULL,
              LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
-             0, USB_ID_VENDOR, USB_ID_PRODUCT,
+             LIBUSB_HOTPLUG_ENUMERATE, vendor_id, product_id,
              LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, NULL, &callback);
 
        if (hotplug_ret != LIBUSB_SUCCESS) {
            fprintf(stderr, "cannot register hotplug callback, hotplugging not enabled\n");
            hotplug_capability = 0;
+           scan_adapters();
        }
    }
+   startup_scanning = false;
+   if (startup_adapters > 0)
+      fprintf(stderr, "found %d adapters %.1f ms after startup\n", startup_adapters,
+            (now_ns() - startup_time) / (double)NSEC_PER_MSEC);
 
    // pump events until shutdown & all helper threads finish cleaning up
    while (!quitting)
-      libusb_handle_events_completed(NULL, (int *)&quitting);
+   {
+      event_loop_run(-1);
+      reap_adapters();
+      reap_port_maps();
+      if (reload_requested)
+      {
+         reload_requested = 0;
+         if (install_profile())
+            fprintf(stderr, "profile %s reloaded\n", profile_path);
+         else
+            fprintf(stderr, "keeping the previous profile\n");
+      }
+   }
+
+   while (adapter_count > 0)
+      remove_adapter(adapter_list[0]);
 
-   while (adapters.next)
-      remove_adapter(adapters.next->device);
+   while (dying_adapters || opening_adapters)
+   {
+      event_loop_run(100);
+      reap_adapters();
+   }
 
    if (hotplug_capability)
       libusb_hotplug_deregister_callback(NULL, callback);
 
+   hotplug_exit();
+   io_threads_exit();
+
+   if (synthetic_count > 0)
+      synthetic_exit();
+   replay_exit();
+   if (capture_file != NULL)
+      capture_exit();
+   if (shm != NULL)
+      shm_exit();
+   if (control_path != NULL)
+      control_exit();
+
+   watch_remove(&stats_watch);
+   close(stats_watch.fd);
+
+   libusb_set_pollfd_notifiers(NULL, NULL, NULL, NULL);
+   close(epoll_fd);
+
    libusb_exit(NULL);
+   if (dma_latency_fd >= 0)
+      close(dma_latency_fd);
+   free_profiles();
    udev_device_unref(uinput);
    udev_unref(udev);
    return 0;
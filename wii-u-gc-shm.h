@@ -0,0 +1,101 @@
+// See LICENSE for license
+
+// Layout of the shared memory segment published with --shm, and helpers to
+// read it. Every port slot is guarded by a seqlock: the daemon never waits
+// for readers, readers retry if they raced with an update.
+
+#ifndef WII_U_GC_SHM_H
+#define WII_U_GC_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define GC_SHM_MAGIC 0x47435348 // "GCSH"
+#define GC_SHM_VERSION 2
+
+// one slot group of four ports for every adapter slot the daemon has
+#define GC_SHM_ADAPTERS 64
+#define GC_SHM_PORTS (GC_SHM_ADAPTERS * 4)
+
+struct gc_shm_port
+{
+   // odd while the daemon is updating the slot
+   uint32_t seq;
+   uint8_t connected;
+   // STATE_NORMAL (0x10) or STATE_WAVEBIRD (0x20)
+   uint8_t type;
+   uint8_t extra_power;
+   uint8_t reserved0;
+   // same bit order as the report, after calibration and the L/R thresholds
+   // but before the profile's button mapping and combos
+   uint16_t buttons;
+   // x, y, cx, cy, l, r as written to the input device
+   uint8_t axis[6];
+   // reports the adapter has delivered so far
+   uint64_t report;
+   // CLOCK_MONOTONIC time of that report in nanoseconds
+   int64_t time;
+   uint8_t reserved1[32];
+};
+
+struct gc_shm_header
+{
+   uint32_t magic;
+   uint32_t version;
+   uint32_t port_count;
+   uint32_t port_size;
+   uint8_t reserved[48];
+};
+
+struct gc_shm
+{
+   struct gc_shm_header header;
+   // the adapter in slot n owns ports[n*4] to ports[n*4+3], so ports[k] is
+   // what the daemon calls port k+1
+   struct gc_shm_port ports[GC_SHM_PORTS];
+};
+
+// map a segment read-only, NULL if it doesn't exist or doesn't match
+static inline const struct gc_shm *gc_shm_open(const char *name)
+{
+   int fd = shm_open(name, O_RDONLY, 0);
+   if (fd < 0)
+      return NULL;
+   void *map = mmap(NULL, sizeof(struct gc_shm), PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED)
+      return NULL;
+
+   const struct gc_shm *shm = (const struct gc_shm *)map;
+   if (shm->header.magic != GC_SHM_MAGIC || shm->header.version != GC_SHM_VERSION
+         || shm->header.port_size != sizeof(struct gc_shm_port))
+   {
+      munmap(map, sizeof(struct gc_shm));
+      return NULL;
+   }
+   return shm;
+}
+
+static inline void gc_shm_close(const struct gc_shm *shm)
+{
+   munmap((void *)shm, sizeof(struct gc_shm));
+}
+
+// copy a consistent snapshot of one port, never blocks the daemon
+static inline void gc_shm_read_port(const struct gc_shm *shm, int index, struct gc_shm_port *out)
+{
+   const struct gc_shm_port *slot = &shm->ports[index];
+   uint32_t before, after;
+   do
+   {
+      before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+      memcpy(out, slot, sizeof(*out));
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      after = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+   } while ((before & 1) != 0 || before != after);
+}
+
+#endif